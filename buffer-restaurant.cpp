@@ -2,31 +2,76 @@
 #include <sys/mman.h> 
 #include <stdio.h> 
 #include <unistd.h> 
-#include <semaphore.h> 
 #include <time.h> 
 #include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <atomic>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+using namespace std;
 
 // This program is an exercise on semaphores and buffers, with a restaurant-themed twist. There are
-// two chefs and three types of customers: vegan and non-vegan, and additionally hybrid for customers. 
+// two kinds of chefs and three types of customers: vegan and non-vegan, and additionally hybrid for
+// customers. Each tray is a lock-free bounded buffer that any number of chefs and customers share:
+// handing a dish over is a compare-and-swap and a few atomic loads and stores, and a thread only
+// makes a futex system call when it has to sleep on a full or empty tray. How many of each kind of
+// thread to start, and how big the trays are, can be set from the command line, and -b runs a
+// timed stress test that reports how many dishes per second get through.
 
 
 #define BUFFER_SIZE 10
 
-int * NVtray;
-int * Vtray;
-
-int NVin;
-int NVout;
-int Vin;
-int Vout;
-
-sem_t NVmutex;
-sem_t NVfull;
-sem_t NVempty;
-
-sem_t Vmutex;
-sem_t Vfull;
-sem_t Vempty;
+// Times a full or empty buffer is tried again before the thread sleeps on it. On a single CPU the
+// other threads can't make progress while this one spins, so it sleeps right away
+#define BUFFER_SPINS 1024
+
+/* A bounded multi-producer, multi-consumer queue with sequence-numbered slots, after Dmitry Vyukov's.
+Slot i starts with sequence i. A producer that claims position pos writes the slot once its sequence
+is pos and then sets it to pos + 1; a consumer that claims pos reads it once the sequence is pos + 1
+and then sets it to pos + capacity, handing it to the producer one lap later. Producers and
+consumers only contend on their own position counter, each on its own cache line.
+notFull and notEmpty are futex words, bumped on a push or pop only while some thread sleeps on the
+other side, and closing the buffer wakes everyone. */
+template <typename T>
+struct BoundedBuffer {
+    struct Slot {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    Slot * slots;
+    size_t capacity;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) atomic<size_t> dequeuePos;
+    alignas(64) atomic<uint32_t> notFull;
+    atomic<uint32_t> producersWaiting;
+    alignas(64) atomic<uint32_t> notEmpty;
+    atomic<uint32_t> consumersWaiting;
+    atomic<bool> closed;
+};
+
+/* One chef or customer thread: its number among its kind, and how many dishes it has handled */
+struct alignas(64) Worker {
+    int index;
+    long dishes;
+};
+
+int bufferSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? BUFFER_SPINS : 0;
+
+BoundedBuffer<int> NVtray;
+BoundedBuffer<int> Vtray;
+
+// Set from the command line: chefs and customers per tray, hybrid customers, tray size, and the
+// length of a stress test (0 to run the restaurant normally)
+int numChefs = 1;
+int numCustomers = 1;
+int numHybrids = 1;
+int traySize = BUFFER_SIZE;
+int stressSeconds = 0;
 
 void *donatelloFunction(void* arg);
 void *NVconsumerFunction(void* arg);
@@ -34,132 +79,387 @@ void *portecelliFunction(void* arg);
 void *VconsumerFunction(void* arg);
 void *hybridConsumerFunction(void * param);
 
-/* Main()
-Creates and initalizes the two bounded buffers, then initializes the semaphores for each and creates 
-the five producer and consumer threads. Afterwards, it counts and prints the number of items in each
-tray every 10 seconds.
+/* futexWait() and futexWake()
+Sleep while the word at address still holds expected, and wake up to count threads sleeping on it.
 */
 
-int main() {
+void futexWait(atomic<uint32_t> * address, uint32_t expected) {
+    syscall(SYS_futex, (uint32_t *) address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
 
-    srand(time(NULL));
+void futexWake(atomic<uint32_t> * address, int count) {
+    syscall(SYS_futex, (uint32_t *) address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-    printf("\n\n\033[0mNon-vegan items are represented as \033[31mred\033[0m\nVegan items are represented as \033[32mgreen\033[0m\n\n");
+/* bufferInit()
+Sets up an empty buffer with room for capacity items. capacity must be at least 2: with a single slot,
+"filled for this lap" and "free for the next lap" are the same sequence number.
+*/
 
-    sleep(3);
+template <typename T>
+void bufferInit(BoundedBuffer<T> & buffer, size_t capacity) {
 
-    // Initialize the bounded buffer trays
-    NVtray = (int*)malloc(BUFFER_SIZE*sizeof(int));
-    Vtray = (int*)malloc(BUFFER_SIZE*sizeof(int));
+    buffer.slots = new typename BoundedBuffer<T>::Slot[capacity];
+    buffer.capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        buffer.slots[i].sequence.store(i, memory_order_relaxed);
+    }
+    buffer.enqueuePos.store(0, memory_order_relaxed);
+    buffer.dequeuePos.store(0, memory_order_relaxed);
+    buffer.closed.store(false, memory_order_relaxed);
+}
+
+/* bufferTryPush()
+Adds an item if there is room, without waiting. Returns false if the buffer is full.
+*/
+
+template <typename T>
+bool bufferTryPush(BoundedBuffer<T> & buffer, const T & item) {
+
+    size_t pos = buffer.enqueuePos.load(memory_order_relaxed);
+    typename BoundedBuffer<T>::Slot * slot;
 
-    for (int i = 0; i < BUFFER_SIZE; i++) {
-        NVtray[i] = 0;
-        Vtray[i] = 0;
+    while (true) {
+        slot = &buffer.slots[pos % buffer.capacity];
+        size_t sequence = slot->sequence.load(memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) pos;
+
+        if (difference == 0) {
+            // The slot is free for this lap; claim the position
+            if (buffer.enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            // The slot still holds last lap's item
+            return false;
+        } else {
+            // Another producer claimed pos first
+            pos = buffer.enqueuePos.load(memory_order_relaxed);
+        }
     }
 
-    // Initialize semaphores
-    sem_init(&NVmutex, 0, 1);
-    sem_init(&NVempty, 0, BUFFER_SIZE);
-    sem_init(&NVfull, 0, 0);
+    slot->value = item;
+    slot->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+/* bufferTryPop()
+Takes the oldest item if there is one, without waiting. Returns false if the buffer is empty.
+*/
 
-    sem_init(&Vmutex, 0, 1);
-    sem_init(&Vempty, 0, BUFFER_SIZE);
-    sem_init(&Vfull, 0, 0);
+template <typename T>
+bool bufferTryPop(BoundedBuffer<T> & buffer, T & item) {
 
-    pthread_t donatello;
-    pthread_t NVconsumer;
-    pthread_t portecelli;
-    pthread_t Vconsumer;
-    pthread_t hybridConsumer;
+    size_t pos = buffer.dequeuePos.load(memory_order_relaxed);
+    typename BoundedBuffer<T>::Slot * slot;
 
-    // create Donatello
-    if (pthread_create(&donatello, NULL, donatelloFunction, NULL) != 0) {
-        printf("Error creating Donatello\n");
+    while (true) {
+        slot = &buffer.slots[pos % buffer.capacity];
+        size_t sequence = slot->sequence.load(memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+        if (difference == 0) {
+            if (buffer.dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false;
+        } else {
+            pos = buffer.dequeuePos.load(memory_order_relaxed);
+        }
     }
 
-    // create non-vegan consumer
-    if (pthread_create(&NVconsumer, NULL, NVconsumerFunction, NULL) != 0) {
-        printf("Error creating Non-vegan consumer\n");
+    item = slot->value;
+    slot->sequence.store(pos + buffer.capacity, memory_order_release);
+    return true;
+}
+
+/* bufferNotify()
+Wakes one thread sleeping on word, if any thread is waiting on it at all. The fence orders the push
+or pop that was just made before the check of waiting, pairing with the waiter announcing itself
+before trying again, so either the waiter sees the change or this sees the waiter.
+*/
+
+void bufferNotify(atomic<uint32_t> & word, atomic<uint32_t> & waiting) {
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiting.load(memory_order_relaxed) > 0) {
+        word.fetch_add(1, memory_order_relaxed);
+        futexWake(&word, 1);
+    }
+}
+
+/* bufferPush()
+Adds an item, spinning briefly and then sleeping on notFull while the buffer is full.
+Returns false if the buffer was closed first.
+*/
+
+template <typename T>
+bool bufferPush(BoundedBuffer<T> & buffer, const T & item) {
+
+    for (int spins = 0; ; spins++) {
+        if (buffer.closed.load(memory_order_acquire)) return false;
+
+        if (bufferTryPush(buffer, item)) {
+            bufferNotify(buffer.notEmpty, buffer.consumersWaiting);
+            return true;
+        }
+
+        if (spins < bufferSpins) {
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        // Announce the wait before trying again, so a consumer can't miss it and skip the wake
+        uint32_t seen = buffer.notFull.load(memory_order_acquire);
+        buffer.producersWaiting.fetch_add(1, memory_order_seq_cst);
+        bool pushed = bufferTryPush(buffer, item);
+        if (!pushed && !buffer.closed.load(memory_order_acquire)) {
+            futexWait(&buffer.notFull, seen);
+        }
+        buffer.producersWaiting.fetch_sub(1, memory_order_relaxed);
+
+        if (pushed) {
+            bufferNotify(buffer.notEmpty, buffer.consumersWaiting);
+            return true;
+        }
     }
+}
+
+/* bufferPop()
+Takes the oldest item, spinning briefly and then sleeping on notEmpty while the buffer is empty.
+Returns false if the buffer was closed first.
+*/
+
+template <typename T>
+bool bufferPop(BoundedBuffer<T> & buffer, T & item) {
+
+    for (int spins = 0; ; spins++) {
+        if (buffer.closed.load(memory_order_acquire)) return false;
 
-    // create Portecelli
-    if (pthread_create(&donatello, NULL, portecelliFunction, NULL) != 0) {
-        printf("Error creating Donatello\n");
+        if (bufferTryPop(buffer, item)) {
+            bufferNotify(buffer.notFull, buffer.producersWaiting);
+            return true;
+        }
+
+        if (spins < bufferSpins) {
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        uint32_t seen = buffer.notEmpty.load(memory_order_acquire);
+        buffer.consumersWaiting.fetch_add(1, memory_order_seq_cst);
+        bool popped = bufferTryPop(buffer, item);
+        if (!popped && !buffer.closed.load(memory_order_acquire)) {
+            futexWait(&buffer.notEmpty, seen);
+        }
+        buffer.consumersWaiting.fetch_sub(1, memory_order_relaxed);
+
+        if (popped) {
+            bufferNotify(buffer.notFull, buffer.producersWaiting);
+            return true;
+        }
     }
+}
+
+/* bufferClose()
+Makes every waiting and later push and pop return false, waking all threads sleeping on the buffer.
+*/
+
+template <typename T>
+void bufferClose(BoundedBuffer<T> & buffer) {
+
+    buffer.closed.store(true, memory_order_seq_cst);
+    buffer.notFull.fetch_add(1, memory_order_seq_cst);
+    buffer.notEmpty.fetch_add(1, memory_order_seq_cst);
+    futexWake(&buffer.notFull, INT_MAX);
+    futexWake(&buffer.notEmpty, INT_MAX);
+}
+
+/* bufferSize()
+Returns how many items are in the buffer. Only a snapshot when other threads are using it.
+*/
 
-    // create vegan consumer
-    if (pthread_create(&NVconsumer, NULL, VconsumerFunction, NULL) != 0) {
-        printf("Error creating vegan consumer\n");
+template <typename T>
+int bufferSize(BoundedBuffer<T> & buffer) {
+
+    size_t dequeued = buffer.dequeuePos.load(memory_order_acquire);
+    size_t enqueued = buffer.enqueuePos.load(memory_order_acquire);
+    if (enqueued <= dequeued) return 0;
+    return enqueued - dequeued > buffer.capacity ? buffer.capacity : enqueued - dequeued;
+}
+
+/* workerName()
+Names a chef or customer for the console: just its kind when there is only one of it, and with its
+number otherwise.
+*/
+
+void workerName(char * name, size_t size, const char * kind, int index, int count) {
+
+    if (count == 1) {
+        snprintf(name, size, "%s", kind);
+    } else {
+        snprintf(name, size, "%s %d", kind, index + 1);
     }
+}
+
+/* startWorkers()
+Creates count threads running function, each with its own Worker.
+*/
+
+void startWorkers(vector<pthread_t> & threads, vector<Worker> & workers, int count, void * (*function)(void *),
+    const char * kind) {
 
-    // create hybrid consumer
-    if (pthread_create(&hybridConsumer, NULL, hybridConsumerFunction, NULL) != 0) {
-        printf("Error creating hybrid consumer\n");
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].dishes = 0;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, function, &workers[i]) != 0) {
+            printf("Error creating %s\n", kind);
+            continue;
+        }
+        threads.push_back(thread);
     }
+}
 
-    // Count and print the number of items in each tray, every 10 seconds
-    int NVitems = 0;
-    int Vitems = 0;
+/* Main()
+Reads the chef, customer and tray settings from the command line, creates the two bounded buffer
+trays, and creates the producer and consumer threads. Afterwards, it prints the number of items in
+each tray every 10 seconds. In a stress test it instead lets the threads run flat out for the given
+time, then closes the trays and reports how many dishes got through.
+*/
 
-    while (true) {
-        for (int i = 0; i < BUFFER_SIZE; i++) {
-            if (NVtray[i] != 0) NVitems++;
-            if (Vtray[i] != 0) Vitems++;
+int main(int argc, char * argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:y:s:b:")) != -1) {
+        if (opt == 'c' && atoi(optarg) >= 1) {
+            numChefs = atoi(optarg);
+        } else if (opt == 'm' && atoi(optarg) >= 1) {
+            numCustomers = atoi(optarg);
+        } else if (opt == 'y' && atoi(optarg) >= 0) {
+            numHybrids = atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) >= 2) {
+            traySize = atoi(optarg);
+        } else if (opt == 'b' && atoi(optarg) >= 1) {
+            stressSeconds = atoi(optarg);
+        } else {
+            printf("Usage: %s [-c chefs per tray] [-m customers per tray] [-y hybrid customers] [-s tray size] [-b stress seconds]\n", argv[0]);
+            exit(0);
         }
-        printf("\n\n\033[31mItems in non-vegan tray: %d/%d\033[0m\n", NVitems, BUFFER_SIZE);
-        printf("\033[32mItems in vegan tray: %d/%d\033[0m\n\n", Vitems, BUFFER_SIZE);
-        NVitems = 0;
-        Vitems = 0;
+    }
+
+    srand(time(NULL));
+
+    if (stressSeconds == 0) {
+        printf("\n\n\033[0mNon-vegan items are represented as \033[31mred\033[0m\nVegan items are represented as \033[32mgreen\033[0m\n\n");
+
+        sleep(3);
+    }
+
+    // Initialize the bounded buffer trays
+    bufferInit(NVtray, traySize);
+    bufferInit(Vtray, traySize);
+
+    vector<pthread_t> threads;
+    vector<Worker> donatellos(numChefs);
+    vector<Worker> portecellis(numChefs);
+    vector<Worker> NVconsumers(numCustomers);
+    vector<Worker> Vconsumers(numCustomers);
+    vector<Worker> hybridConsumers(numHybrids);
+
+    double start = 0;
+    if (stressSeconds > 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        start = ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // create the chefs and customers
+    startWorkers(threads, donatellos, numChefs, donatelloFunction, "Donatello");
+    startWorkers(threads, NVconsumers, numCustomers, NVconsumerFunction, "non-vegan consumer");
+    startWorkers(threads, portecellis, numChefs, portecelliFunction, "Portecelli");
+    startWorkers(threads, Vconsumers, numCustomers, VconsumerFunction, "vegan consumer");
+    startWorkers(threads, hybridConsumers, numHybrids, hybridConsumerFunction, "hybrid consumer");
+
+    // Count and print the number of items in each tray, every 10 seconds
+    while (stressSeconds == 0) {
+        printf("\n\n\033[31mItems in non-vegan tray: %d/%d\033[0m\n", bufferSize(NVtray), traySize);
+        printf("\033[32mItems in vegan tray: %d/%d\033[0m\n\n", bufferSize(Vtray), traySize);
         sleep(10);
-    }    
+    }
+
+    // Stress test: stop everyone once the time is up
+    sleep(stressSeconds);
+    bufferClose(NVtray);
+    bufferClose(Vtray);
+
+    for (int i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double seconds = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+
+    // Every dish that got through was taken by a customer; a hybrid customer takes two per meal
+    long dishes = 0;
+    for (int i = 0; i < numCustomers; i++) {
+        dishes += NVconsumers[i].dishes + Vconsumers[i].dishes;
+    }
+    for (int i = 0; i < numHybrids; i++) {
+        dishes += hybridConsumers[i].dishes;
+    }
 
-    pthread_join(donatello, NULL);
-    pthread_join(NVconsumer, NULL);
-    pthread_join(portecelli, NULL);
-    pthread_join(Vconsumer, NULL);
-    pthread_join(hybridConsumer, NULL);
+    printf("chefs_per_tray,customers_per_tray,hybrids,tray_size,threads,seconds,dishes,dishes_per_second\n");
+    printf("%d,%d,%d,%d,%d,%.3f,%ld,%.0f\n", numChefs, numCustomers, numHybrids, traySize, (int) threads.size(),
+        seconds, dishes, dishes / seconds);
 
-    free(NVtray);
-    free(Vtray);
+    delete[] NVtray.slots;
+    delete[] Vtray.slots;
     return 0;
 }
 
 /* donatelloFunction()
-Function to handle the non-vegan producer Donatello. Enters a while loop waiting for the two semaphores,
-then generates a random dish and adds it to the tray. Posts/signals the appropriate semaphores and then 
-sleeps for 1-5 seconds before looping again.
+Function to handle the non-vegan producers, Donatello. Enters a while loop generating a random dish
+and adding it to the tray, waiting if the tray is full, then sleeps for 1-5 seconds before looping
+again. In a stress test it adds dishes as fast as it can, without printing, until the tray closes.
 */
 
 void * donatelloFunction(void * param) {
 
+    Worker * worker = (Worker *) param;
+    char name[32];
+    workerName(name, sizeof(name), "Donatello", worker->index, numChefs);
+
+    if (stressSeconds > 0) {
+        int dish = 1;
+        while (bufferPush(NVtray, dish)) {
+            worker->dishes++;
+            dish = 3 - dish;
+        }
+        pthread_exit(0);
+    }
+
     int dishAdded = 0;
     sleep(1);
 
     // While loop to add items to non-vegan tray
     while (true) {
 
-        // Wait for appropriate semaphores
-        sem_wait(&NVempty);
-        sem_wait(&NVmutex);
-        
         // Produce a random number, either 1 or 2, for the dish
         dishAdded = rand() % 2 + 1;
-        NVtray[NVin] = dishAdded;
-        NVin = (NVin+1)%BUFFER_SIZE;
 
         // Print result to the console
         switch(dishAdded) {
             case 1:
-                printf("Donatello creates non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m\n");
+                printf("%s creates non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m\n", name);
                 break;
             case 2:
-                printf("Donatello creates non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m\n");
+                printf("%s creates non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m\n", name);
                 break;
         }
-        
-        // Post the appropriate semaphores
-        sem_post(&NVfull);
-        sem_post(&NVmutex);
+
+        // Add the dish to the tray once there is room, after announcing it so no customer can be
+        // seen taking it first
+        bufferPush(NVtray, dishAdded);
+        worker->dishes++;
 
         //Sleep between 1 and 5 seconds
         sleep(1 + rand() % 5);
@@ -169,40 +469,41 @@ void * donatelloFunction(void * param) {
 }
 
 /* NVconsumerFunction()
-Function to handle the non-vegan consumers. Enters a while loop waiting for the two semaphores,
-then takes the next dish from the non-vegan tray. Posts/signals the appropriate semaphores and then 
-sleeps for 10-15 seconds before looping again.
+Function to handle the non-vegan consumers. Enters a while loop taking the next dish from the
+non-vegan tray, waiting if it is empty, then sleeps for 10-15 seconds before looping again. In a
+stress test it takes dishes as fast as it can, without printing, until the tray closes.
 */
 
 void * NVconsumerFunction(void * param) {
 
+    Worker * worker = (Worker *) param;
+    char name[32];
+    workerName(name, sizeof(name), "Non-vegan customer", worker->index, numCustomers);
     int dishRemoved = 0;
 
+    if (stressSeconds > 0) {
+        while (bufferPop(NVtray, dishRemoved)) {
+            worker->dishes++;
+        }
+        pthread_exit(0);
+    }
+
     while (true) {
 
-        // Wait for semaphores
-        sem_wait(&NVfull);
-        sem_wait(&NVmutex);
-        
         // Remove a dish from the non-vegan tray
-        int dishRemoved = NVtray[NVout];
-        NVtray[NVout] = 0;
-        NVout = (NVout+1)%BUFFER_SIZE;
+        bufferPop(NVtray, dishRemoved);
+        worker->dishes++;
 
         // Print the result to the console
         switch(dishRemoved) {
             case 1:
-                printf("Non-vegan customer removes non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m\n");
+                printf("%s removes non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m\n", name);
                 break;
             case 2:
-                printf("Non-vegan customer removes non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m\n");
+                printf("%s removes non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m\n", name);
                 break;
         }
 
-        // Post the semaphores
-        sem_post(&NVmutex);
-        sem_post(&NVempty);
-
         // Sleep between 10 and 15 seconds
         sleep(10 + rand() % 6);
     }
@@ -211,40 +512,48 @@ void * NVconsumerFunction(void * param) {
 }
 
 /* portecelliFunction()
-Function to handle the vegan producer Portecelli. Enters a while loop waiting for the two semaphores,
-then generates a random dish and adds it to the tray. Posts/signals the appropriate semaphores and then 
-sleeps for 1-5 seconds before looping again.
+Function to handle the vegan producers, Portecelli. Enters a while loop generating a random dish and
+adding it to the tray, waiting if the tray is full, then sleeps for 1-5 seconds before looping
+again. In a stress test it adds dishes as fast as it can, without printing, until the tray closes.
 */
 
 void * portecelliFunction(void * param) {
 
+    Worker * worker = (Worker *) param;
+    char name[32];
+    workerName(name, sizeof(name), "Portecelli", worker->index, numChefs);
+
+    if (stressSeconds > 0) {
+        int dish = 1;
+        while (bufferPush(Vtray, dish)) {
+            worker->dishes++;
+            dish = 3 - dish;
+        }
+        pthread_exit(0);
+    }
+
     int dishAdded = 0;
     sleep(1);
 
     while (true) {
 
-        // Wait for the semaphores
-        sem_wait(&Vempty);
-        sem_wait(&Vmutex);
-        
         // Produce a random number, either 1 or 2, for the dish
         dishAdded = rand() % 2 + 1;
-        Vtray[Vin] = dishAdded;
-        Vin = (Vin+1)%BUFFER_SIZE;
 
         // Print the result to the console
         switch(dishAdded) {
             case 1:
-                printf("Portecelli creates vegan dish: \033[32mPistachio Pesto Pasta\033[0m\n");
+                printf("%s creates vegan dish: \033[32mPistachio Pesto Pasta\033[0m\n", name);
                 break;
             case 2:
-                printf("Portecelli creates vegan dish: \033[32mAvocado Fruit Salad\033[0m\n");
+                printf("%s creates vegan dish: \033[32mAvocado Fruit Salad\033[0m\n", name);
                 break;
         }
-        
-        // Post the semaphores
-        sem_post(&Vfull);
-        sem_post(&Vmutex);
+
+        // Add the dish to the tray once there is room, after announcing it so no customer can be
+        // seen taking it first
+        bufferPush(Vtray, dishAdded);
+        worker->dishes++;
 
         //Sleep between 1 and 5 seconds
         sleep(1 + rand() % 5);
@@ -254,40 +563,41 @@ void * portecelliFunction(void * param) {
 }
 
 /* VconsumerFunction()
-Function to handle the vegan consumers. Enters a while loop waiting for the two semaphores,
-then removes the next dish from the vegan tray. Posts/signals the appropriate semaphores and then 
-sleeps for 10-15 seconds before looping again.
+Function to handle the vegan consumers. Enters a while loop removing the next dish from the vegan
+tray, waiting if it is empty, then sleeps for 10-15 seconds before looping again. In a stress test
+it takes dishes as fast as it can, without printing, until the tray closes.
 */
 
 void * VconsumerFunction(void * param) {
 
+    Worker * worker = (Worker *) param;
+    char name[32];
+    workerName(name, sizeof(name), "Vegan customer", worker->index, numCustomers);
     int dishRemoved = 0;
 
+    if (stressSeconds > 0) {
+        while (bufferPop(Vtray, dishRemoved)) {
+            worker->dishes++;
+        }
+        pthread_exit(0);
+    }
+
     while (true) {
 
-        // Wait for the semaphores
-        sem_wait(&Vfull);
-        sem_wait(&Vmutex);
-        
         // Remove a dish from the vegan tray
-        int dishRemoved = Vtray[Vout];
-        Vtray[Vout] = 0;
-        Vout = (Vout+1)%BUFFER_SIZE;
+        bufferPop(Vtray, dishRemoved);
+        worker->dishes++;
 
         // Print the result to the console
         switch(dishRemoved) {
             case 1:
-                printf("Vegan customer removes vegan dish: \033[32mPistachio Pesto Pasta\033[0m\n");
+                printf("%s removes vegan dish: \033[32mPistachio Pesto Pasta\033[0m\n", name);
                 break;
             case 2:
-                printf("Vegan customer removes vegan dish: \033[32mAvocado Fruit Salad\033[0m\n");
+                printf("%s removes vegan dish: \033[32mAvocado Fruit Salad\033[0m\n", name);
                 break;
         }
 
-        // Post the semaphores
-        sem_post(&Vmutex);
-        sem_post(&Vempty);
-
         // Sleep between 10 and 15 seconds
         sleep(10 + rand() % 6);
     }
@@ -296,43 +606,45 @@ void * VconsumerFunction(void * param) {
 }
 
 /* hybridConsumerFunction()
-Function to handle the hybrid consumers. Enters a while loop waiting for all four semaphores,
-then removes the next dish from the non-vegan tray and the vegan tray. Posts/signals the 
-appropriate semaphores and then sleeps for 10-15 seconds before looping again.
+Function to handle the hybrid consumers. Enters a while loop removing the next dish from the
+non-vegan tray and then from the vegan tray, waiting on each if it is empty, then sleeps for 10-15
+seconds before looping again. In a stress test it eats as fast as it can, without printing, until
+the trays close.
 */
 
 void * hybridConsumerFunction(void * param) {
 
+    Worker * worker = (Worker *) param;
+    char name[32];
+    workerName(name, sizeof(name), "Hybrid customer", worker->index, numHybrids);
     int NVdishRemoved = 0;
     int VdishRemoved = 0;
 
+    if (stressSeconds > 0) {
+        while (bufferPop(NVtray, NVdishRemoved)) {
+            worker->dishes++;
+            if (!bufferPop(Vtray, VdishRemoved)) break;
+            worker->dishes++;
+        }
+        pthread_exit(0);
+    }
+
     while (true) {
 
-        // Wait for all four semaphores
-        sem_wait(&NVfull);
-        sem_wait(&NVmutex);
-        sem_wait(&Vfull);
-        sem_wait(&Vmutex);
-        
-        // Remove a dish from the non-vegan tray
-        int NVdishRemoved = NVtray[NVout];
-        NVtray[NVout] = 0;
-        NVout = (NVout+1)%BUFFER_SIZE;
+        // Remove a dish from the non-vegan tray, then one from the vegan tray
+        bufferPop(NVtray, NVdishRemoved);
+        bufferPop(Vtray, VdishRemoved);
+        worker->dishes += 2;
 
         switch(NVdishRemoved) {
             case 1:
-                printf("Hybrid customer removes non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m");
+                printf("%s removes non-vegan dish: \033[31mFettuccine Chicken Alfredo\033[0m", name);
                 break;
             case 2:
-                printf("Hybrid customer removes non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m");
+                printf("%s removes non-vegan dish: \033[31mGarlic Sirloin Steak\033[0m", name);
                 break;
         }
 
-        // Remove a dish from the vegan tray
-        int VdishRemoved = Vtray[Vout];
-        Vtray[Vout] = 0;
-        Vout = (Vout+1)%BUFFER_SIZE;
-
         switch(VdishRemoved) {
             case 1:
                 printf(", and vegan dish: \033[32mPistachio Pesto Pasta\033[0m\n");
@@ -342,15 +654,9 @@ void * hybridConsumerFunction(void * param) {
                 break;
         }
 
-        // Post all four semaphores
-        sem_post(&NVmutex);
-        sem_post(&NVempty);
-        sem_post(&Vmutex);
-        sem_post(&Vempty);
-
         // Sleep between 10 and 15 seconds
         sleep(10 + rand() % 6);
     }
 
     pthread_exit(0);
-}
\ No newline at end of file
+}
@@ -12,18 +12,272 @@
 #include <mutex>
 #include <iostream>
 #include <vector>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <dirent.h>
+#include <atomic>
 
 #define ARR_SIZE 1000000
 
+// Build with -DPRIME_STATS to collect per-thread counters and timers. Without it the
+// STAT_ macros expand to nothing and the hot paths carry no instrumentation at all.
+#ifdef PRIME_STATS
+#define STAT_ADD(field, value) \
+	do { if (myStats) myStats->field.store(myStats->field.load(memory_order_relaxed) + (value), \
+		memory_order_relaxed); } while (0)
+#define STAT_TIMER_START(name) double name = now()
+#define STAT_TIMER_STOP(field, name) STAT_ADD(field, (uint64_t) ((now() - (name)) * 1e9))
+#else
+#define STAT_ADD(field, value) do { } while (0)
+#define STAT_TIMER_START(name) do { } while (0)
+#define STAT_TIMER_STOP(field, name) do { } while (0)
+#endif
+
+// Bytes of sieve bitmap handled per segment, sized to fit in L1/L2 cache
+#define SEGMENT_BYTES 32768
+#define SEGMENT_BITS (SEGMENT_BYTES * 8)
+
+// Primes up to sqrt(2^32), enough to trial divide any 32-bit number
+#define SMALL_PRIME_LIMIT 65536
+#define NUM_SMALL_PRIMES 6542
+
+// Wheel of 2*3*5*7 used to pre-filter numbers before trial division
+#define WHEEL_SIZE 210
+
+// Default primality cache size in entries when only a cache file is given (32 MiB)
+#define CACHE_DEFAULT_CAPACITY ((uint64_t) 1 << 22)
+// Slots looked at before a cache lookup gives up or an insert is dropped
+#define CACHE_MAX_PROBE 16
+// Cache file header: "PRIMECCH", then the format version and the bytes per entry
+#define CACHE_MAGIC "PRIMECCH"
+#define CACHE_VERSION 1
+
+// Numbers per pipeline block when reading input from a file or stdin
+#define BLOCK_SIZE (1 << 20)
+// Blocks in flight between the reader, the computation threads and the writer
+#define NUM_BLOCKS 3
+
+// Numbers per scheduling chunk handed out to the computation threads. Must be a
+// multiple of 64 so that every word of the result bitmap belongs to one chunk.
+#define CHUNK_SIZE 4096
+
+// Widest [min,max] range the sieve takes on. Only segments holding an input are sieved,
+// but past this the inputs are so sparse that Miller-Rabin is cheaper
+#define SIEVE_MAX_SPAN ((uint64_t) 1 << 34)
+
 using namespace std;
 
-vector<int> numbers;
+// Which classifier the worker threads use
+enum Kernel { KERNEL_TRIAL, KERNEL_SIEVE, KERNEL_MR, KERNEL_SIMD, NUM_KERNELS };
+const char * kernelNames[] = {"trial", "sieve", "mr", "simd"};
+
+// Generated input. Allocated untouched so that each generator thread's slice is
+// placed on that thread's NUMA node when first written.
+uint64_t * numbers;
 int n;
 int arraySize;
-bool * results;
 
-// Code given
-bool isComposite(int n)
+// The block of numbers the computation threads are working on. For generated input
+// this is all of numbers; otherwise it is one block of the input stream.
+const uint64_t * blockValues;
+int blockSize;
+// Bit i is set when blockValues[i] is composite
+uint64_t * results;
+Kernel kernel = KERNEL_TRIAL;
+int digits = 9;
+// Generated input: seed of the counter-based generator, and how many numbers to make
+uint64_t seed;
+int arrayLength = ARR_SIZE;
+
+// Segmented sieve state. The sieveCount odd numbers from sieveLow up are cut into
+// segments of SEGMENT_BITS, and only the segments holding an input are sieved.
+// sieveSegments lists those; the block positions of the inputs in sieveSegments[i]
+// are segmentInputs[segmentStart[i]] up to segmentInputs[segmentStart[i+1]].
+uint64_t sieveLow;
+uint64_t sieveCount;
+uint64_t numSegments;
+vector<uint64_t> basePrimes;
+vector<uint64_t> sieveSegments;
+vector<int> segmentStart;
+vector<int> segmentInputs;
+// Bit i is set when blockValues[i] is composite, filled in by the sieve threads
+atomic<uint64_t> * sieveComposite;
+
+// Trial divisors: the small primes from 5 up, the largest having d*d < 2^32. A 32-bit
+// value v is divisible by an odd d exactly when v * divisorInverse (mod 2^32) is at
+// most divisorLimit, so no hardware division is needed.
+vector<uint32_t> divisorInverse;
+vector<uint32_t> divisorLimit;
+vector<uint32_t> divisorSquare;
+
+// Batched trial division kernel picked at startup for this CPU, and how many
+// numbers it tests per call
+uint32_t (*trialBatch)(const uint32_t * values);
+int batchLanes;
+
+// How pool workers are pinned to CPUs: not at all, packed onto as few cores and
+// nodes as possible, or spread across nodes and physical cores first
+enum Placement { PLACEMENT_NONE, PLACEMENT_COMPACT, PLACEMENT_SCATTER };
+Placement placement = PLACEMENT_NONE;
+
+// CPUs in the order workers are pinned to them
+vector<int> cpuOrder;
+
+// Persistent worker pool. runOnPool() wakes every worker through its start semaphore
+// to run poolTask with its id, then waits for all of them on poolDone.
+pthread_t * poolThreads;
+int * poolIDs;
+sem_t * poolStart;
+sem_t poolDone;
+int poolSize;
+void * (*poolTask)(void *);
+
+#ifdef PRIME_STATS
+// Counters and timers of one worker, each in its own cache line. Only the owning
+// worker writes them; the progress thread and the final report read them. Timers are
+// in nanoseconds.
+struct alignas(64) ThreadStats {
+	atomic<uint64_t> processed;
+	atomic<uint64_t> primes;
+	atomic<uint64_t> divisions;
+	atomic<uint64_t> earlyExits;
+	atomic<uint64_t> wheelExits;
+	atomic<uint64_t> modMultiplies;
+	atomic<uint64_t> generateNanos;
+	atomic<uint64_t> sieveNanos;
+	atomic<uint64_t> classifyNanos;
+};
+
+ThreadStats * threadStats;
+int numThreadStats;
+thread_local ThreadStats * myStats;
+
+// Seconds between progress lines, or 0 for none
+double progressInterval = 0;
+int64_t progressTotal;
+sem_t progressStop;
+#endif
+
+// Per-thread deque of chunk indexes [head, tail). The owner takes chunks from the
+// head and idle threads steal from the tail. Aligned so that two threads' queues
+// never share a cache line.
+struct alignas(64) WorkQueue {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+	double busySeconds;
+	int chunksDone;
+	int chunksStolen;
+	int64_t numPrime;
+	int64_t numComp;
+	int64_t cacheHits;
+	int64_t cacheMisses;
+};
+
+WorkQueue * queues;
+int numChunks;
+
+// Shared primality cache. An open-addressing table of (number << 1 | composite)
+// words, with 0 meaning an empty slot. Each entry is a single atomic word, so
+// lookups are plain loads and inserts claim an empty slot with a compare-and-swap.
+// No locks or shards are needed. The table never grows: when a probe run is full,
+// the new entry overwrites one of the run's entries, picked by the entry's hash, so a
+// full cache keeps following the workload. Slots are never emptied again, so a
+// lookup can still stop at the first empty slot.
+atomic<uint64_t> * cacheTable;
+uint64_t cacheCapacity = 0;
+const char * cachePath = NULL;
+
+// One slot of the input pipeline. values either points into the memory-mapped file
+// or at buffer, which holds numbers parsed from stdin. A count of 0 marks the end.
+struct Block {
+	const uint64_t * values;
+	uint64_t * buffer;
+	uint64_t * bits;
+	int count;
+};
+
+Block blocks[NUM_BLOCKS];
+sem_t blocksEmpty;
+sem_t blocksFull;
+sem_t blocksDone;
+
+// Input and output of the pipeline. inputPath "-" means text on stdin.
+const char * inputPath = NULL;
+const char * outputPath = NULL;
+const uint64_t * inputMap;
+size_t inputMapCount;
+
+// Benchmark mode: report format ("csv" or "json"), and untimed and timed runs per
+// configuration
+const char * benchFormat = NULL;
+int benchWarmups = 1;
+int benchRepetitions = 3;
+// Where progress messages such as the kernel in use go. Benchmark mode sends them to
+// stderr so stdout holds nothing but the report.
+FILE * statusOut = stdout;
+
+/* Returns the current time in seconds from a monotonic clock. */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct PrimeTable {
+	uint32_t primes[NUM_SMALL_PRIMES];
+};
+
+struct WheelTable {
+	bool coprime[WHEEL_SIZE];
+};
+
+/*
+Sieve of Eratosthenes run by the compiler, so the small prime table is part of the
+binary and costs nothing at startup.
+*/
+constexpr PrimeTable makePrimeTable() {
+	PrimeTable table = {};
+	bool composite[SMALL_PRIME_LIMIT + 1] = {};
+	int count = 0;
+
+	for (uint64_t i = 2; i <= SMALL_PRIME_LIMIT; i++) {
+		if (composite[i])
+			continue;
+		table.primes[count++] = i;
+		for (uint64_t j = i * i; j <= SMALL_PRIME_LIMIT; j += i)
+			composite[j] = true;
+	}
+
+	return table;
+}
+
+/*
+Marks the residues mod 2*3*5*7 that share no factor with the wheel, also at compile time.
+*/
+constexpr WheelTable makeWheelTable() {
+	WheelTable wheel = {};
+
+	for (int i = 0; i < WHEEL_SIZE; i++)
+		wheel.coprime[i] = i % 2 != 0 && i % 3 != 0 && i % 5 != 0 && i % 7 != 0;
+
+	return wheel;
+}
+
+constexpr PrimeTable smallPrimes = makePrimeTable();
+constexpr WheelTable wheel = makeWheelTable();
+
+static_assert(smallPrimes.primes[NUM_SMALL_PRIMES - 1] == 65521, "small prime table is incomplete");
+
+// Code given, with the 6k+-1 candidates replaced by the small prime table
+bool isComposite(uint64_t n)
 {
 	// Corner cases
 	if (n <= 1) return false;
@@ -31,113 +285,1560 @@ bool isComposite(int n)
 
 	// This is checked so that we can skip
 	// middle five numbers in below loop
-	if (n%2 == 0 || n%3 == 0) return true;
+	if (n%2 == 0 || n%3 == 0) {
+		STAT_ADD(earlyExits, 1);
+		return true;
+	}
 
-	for (int i=5; i*i<=n; i=i+6)
+	// Anything sharing a factor with the wheel is composite, apart from 5 and 7
+	if (!wheel.coprime[n % WHEEL_SIZE]) {
+		STAT_ADD(wheelExits, 1);
+		return n != 5 && n != 7;
+	}
+
+	// Only real primes are tried, starting from 11
+	for (int i = 4; i < NUM_SMALL_PRIMES; i++) {
+		uint64_t p = smallPrimes.primes[i];
+		if (p*p > n) {
+			STAT_ADD(divisions, i - 4);
+			return false;
+		}
+		if (n%p == 0) {
+			STAT_ADD(divisions, i - 3);
+			return true;
+		}
+	}
+	STAT_ADD(divisions, NUM_SMALL_PRIMES - 4);
+
+	// Past the table (n >= 2^32) carry on with the 6k+-1 candidates. i*i would wrap
+	// around for i near 2^32 and never exceed n, so the bound is i <= n/i instead
+	for (uint64_t i=SMALL_PRIME_LIMIT+1; i<=n/i; i=i+6) {
+		STAT_ADD(divisions, 2);
 		if (n%i == 0 || n%(i+2) == 0)
 		return true;
+	}
+
+	return false;
+}
+
+/*
+Builds the odd base primes up to sqrt(max) with a plain sieve. These are the only
+divisors needed to sieve every segment of [min,max].
+*/
+void generateBasePrimes(uint64_t max) {
+	uint64_t limit = (uint64_t) sqrt((double) max) + 1;
+	vector<bool> composite(limit + 1, false);
+
+	for (uint64_t i = 3; i * i <= limit; i += 2)
+		if (!composite[i])
+			for (uint64_t j = i * i; j <= limit; j += 2 * i)
+				composite[j] = true;
+
+	for (uint64_t i = 3; i <= limit; i += 2)
+		if (!composite[i])
+			basePrimes.push_back(i);
+}
+
+/*
+Prepares the segmented sieve for the [min,max] range of the input. Only odd numbers
+are sieved, and the inputs are bucketed by the segment of SEGMENT_BITS odd numbers
+they fall in, so each segment is sieved once into a cache-sized buffer and all of
+its lookups answered before the buffer is reused. Inputs below 5 and even inputs
+are answered here. Returns false if the range is too wide for the sieve.
+*/
+bool setupSieve() {
+	uint64_t lo = blockValues[0];
+	uint64_t hi = blockValues[0];
+	for (int i = 1; i < blockSize; i++) {
+		if (blockValues[i] < lo) lo = blockValues[i];
+		if (blockValues[i] > hi) hi = blockValues[i];
+	}
+
+	if (lo < 5) lo = 5;
+	if (hi < lo) hi = lo;
+	if (lo % 2 == 0) lo--;
+	if (hi - lo > SIEVE_MAX_SPAN) return false;
+
+	sieveLow = lo;
+	sieveCount = (hi - lo) / 2 + 1;
+	numSegments = (sieveCount + SEGMENT_BITS - 1) / SEGMENT_BITS;
+
+	// Streamed input sieves every block again, so drop the previous block's state
+	delete[] sieveComposite;
+	sieveComposite = new atomic<uint64_t>[(blockSize + 63) / 64];
+	for (int i = 0; i < (blockSize + 63) / 64; i++)
+		sieveComposite[i].store(0, memory_order_relaxed);
+	basePrimes.clear();
+	sieveSegments.clear();
+	segmentStart.clear();
+
+	// Count the inputs of every segment, then place them with a counting sort
+	vector<int> counts(numSegments + 1, 0);
+	for (int i = 0; i < blockSize; i++) {
+		uint64_t v = blockValues[i];
+		if (v <= 3)
+			continue;
+		if (v % 2 == 0) {
+			sieveComposite[i / 64].fetch_or((uint64_t) 1 << (i & 63), memory_order_relaxed);
+			continue;
+		}
+		counts[(v - lo) / 2 / SEGMENT_BITS + 1]++;
+	}
+
+	for (uint64_t segment = 0; segment < numSegments; segment++) {
+		if (counts[segment + 1] > 0) {
+			sieveSegments.push_back(segment);
+			segmentStart.push_back(counts[segment]);
+		}
+		counts[segment + 1] += counts[segment];
+	}
+	segmentStart.push_back(counts[numSegments]);
+
+	segmentInputs.resize(counts[numSegments]);
+	for (int i = 0; i < blockSize; i++) {
+		uint64_t v = blockValues[i];
+		if (v > 3 && v % 2 == 1)
+			segmentInputs[counts[(v - lo) / 2 / SEGMENT_BITS]++] = i;
+	}
+
+	generateBasePrimes(hi);
+	return true;
+}
+
+/*
+Crosses out the multiples of the base primes from basePrimes[from] on inside one
+segment, into bits. Bit j of bits is set when the odd number
+sieveLow + 2 * (segment * SEGMENT_BITS + j) is one of those multiples.
+*/
+void sieveSegment(uint64_t segment, uint64_t * bits, int from) {
+	uint64_t first = segment * SEGMENT_BITS;
+	uint64_t last = first + SEGMENT_BITS;
+	if (last > sieveCount) last = sieveCount;
+
+	uint64_t lowValue = sieveLow + 2 * first;
+	uint64_t highValue = sieveLow + 2 * (last - 1);
+
+	memset(bits, 0, SEGMENT_BYTES);
+
+	for (int i = from; i < basePrimes.size(); i++) {
+		uint64_t p = basePrimes[i];
+		if (p * p > highValue)
+			break;
+
+		// First odd multiple of p in the segment, never below p*p
+		uint64_t start = lowValue + (p - lowValue % p) % p;
+		if (start < p * p) start = p * p;
+		if (start % 2 == 0) start += p;
+
+		// Consecutive odd multiples are 2p apart, which is p bit positions
+		for (uint64_t k = (start - sieveLow) / 2 - first; k < last - first; k += p)
+			bits[k >> 6] |= (uint64_t) 1 << (k & 63);
+	}
+}
+
+/*
+Montgomery multiplication modulo an odd n < 2^64. a and b are in Montgomery form
+(x * 2^64 mod n) and nInv is n^-1 mod 2^64. Returns a * b * 2^-64 mod n.
+*/
+uint64_t montMultiply(uint64_t a, uint64_t b, uint64_t n, uint64_t nInv)
+{
+	unsigned __int128 t = (unsigned __int128) a * b;
+	uint64_t m = (uint64_t) t * nInv;
+	uint64_t mnHigh = (uint64_t) (((unsigned __int128) m * n) >> 64);
+	uint64_t tHigh = (uint64_t) (t >> 64);
+
+	// The low 64 bits of t and m*n are equal, so only the high halves are subtracted
+	return tHigh >= mnHigh ? tHigh - mnHigh : tHigh - mnHigh + n;
+}
+
+/*
+Deterministic Miller-Rabin test. The seven witnesses below (Jim Sinclair's set) give
+a correct answer for every 64-bit n, and each round is O(log n) Montgomery products.
+*/
+bool isCompositeMR(uint64_t n)
+{
+	static const uint64_t witnesses[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+
+	// Corner cases, same as isComposite
+	if (n <= 3) return false;
+	if (n%2 == 0 || n%3 == 0) {
+		STAT_ADD(earlyExits, 1);
+		return true;
+	}
+
+	// n^-1 mod 2^64 by Newton's iteration, each step doubles the correct bits
+	uint64_t nInv = n;
+	for (int i = 0; i < 5; i++)
+		nInv *= 2 - n * nInv;
+
+	// 1 and n-1 in Montgomery form
+	uint64_t one = (uint64_t) (-n) % n;
+	uint64_t minusOne = n - one;
+
+	// n - 1 = d * 2^s with d odd
+	uint64_t d = n - 1;
+	int s = __builtin_ctzll(d);
+	d >>= s;
+
+	for (int w = 0; w < 7; w++) {
+		uint64_t a = witnesses[w] % n;
+		if (a == 0)
+			continue;
+
+		// x = a^d mod n, by square-and-multiply in Montgomery form
+		uint64_t base = (uint64_t) (((unsigned __int128) a << 64) % n);
+		uint64_t x = one;
+		for (uint64_t e = d; e > 0; e >>= 1) {
+			if (e & 1)
+				x = montMultiply(x, base, n, nInv);
+			base = montMultiply(base, base, n, nInv);
+		}
+		// One squaring per bit of d and one multiply per set bit
+		STAT_ADD(modMultiplies, 64 - __builtin_clzll(d) + __builtin_popcountll(d));
+
+		if (x == one || x == minusOne)
+			continue;
+
+		bool witnessed = true;
+		for (int i = 1; i < s; i++) {
+			x = montMultiply(x, x, n, nInv);
+			STAT_ADD(modMultiplies, 1);
+			if (x == minusOne) {
+				witnessed = false;
+				break;
+			}
+		}
+		if (witnessed)
+			return true;
+	}
 
 	return false;
 }
 
+/*
+Fills the divisor tables used by the batched trial division kernels.
+*/
+void setupDivisorTables() {
+	for (int i = 2; i < NUM_SMALL_PRIMES; i++) {
+		uint32_t d = smallPrimes.primes[i];
+
+		// d^-1 mod 2^32 by Newton's iteration
+		uint32_t inv = d;
+		for (int j = 0; j < 4; j++)
+			inv *= 2 - d * inv;
+
+		divisorInverse.push_back(inv);
+		divisorLimit.push_back(UINT32_MAX / d);
+		divisorSquare.push_back(d * d);
+	}
+}
+
+/*
+Scalar fallback of the batched trial division kernel, testing one number per call.
+Returns 1 if values[0] has a divisor in the tables.
+*/
+uint32_t trialBatchScalar(const uint32_t * values) {
+	uint32_t v = values[0];
+
+	for (int j = 0; j < divisorSquare.size(); j++) {
+		if (divisorSquare[j] > v)
+			break;
+		STAT_ADD(divisions, 1);
+		if (v * divisorInverse[j] <= divisorLimit[j])
+			return 1;
+	}
+	return 0;
+}
+
+/*
+AVX2 batched trial division kernel. Tests 8 numbers against the same divisor at a
+time and returns a bitmask of the lanes found to be composite. A lane drops out once
+the divisor passes its square root, and zero lanes are treated as padding.
+*/
+__attribute__((target("avx2")))
+uint32_t trialBatchAvx2(const uint32_t * values) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) values);
+	__m256i found = _mm256_setzero_si256();
+
+	for (int j = 0; j < divisorSquare.size(); j++) {
+		// Lanes still undecided with d*d <= v (AVX2 has no unsigned compare, so min is used)
+		__m256i square = _mm256_set1_epi32(divisorSquare[j]);
+		__m256i inRange = _mm256_cmpeq_epi32(_mm256_min_epu32(square, v), square);
+		__m256i active = _mm256_andnot_si256(found, inRange);
+		if (_mm256_testz_si256(active, active))
+			break;
+		STAT_ADD(divisions, __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(active))));
+
+		__m256i product = _mm256_mullo_epi32(v, _mm256_set1_epi32(divisorInverse[j]));
+		__m256i limit = _mm256_set1_epi32(divisorLimit[j]);
+		__m256i divisible = _mm256_cmpeq_epi32(_mm256_min_epu32(product, limit), product);
+		found = _mm256_or_si256(found, _mm256_and_si256(active, divisible));
+	}
+
+	return _mm256_movemask_ps(_mm256_castsi256_ps(found));
+}
+
+/*
+AVX-512 batched trial division kernel, the same as trialBatchAvx2 but with 16 lanes.
+*/
+__attribute__((target("avx512f")))
+uint32_t trialBatchAvx512(const uint32_t * values) {
+	__m512i v = _mm512_loadu_si512(values);
+	__mmask16 found = 0;
+
+	for (int j = 0; j < divisorSquare.size(); j++) {
+		__m512i square = _mm512_set1_epi32(divisorSquare[j]);
+		__mmask16 active = _mm512_cmple_epu32_mask(square, v) & ~found;
+		if (active == 0)
+			break;
+		STAT_ADD(divisions, __builtin_popcount(active));
+
+		__m512i product = _mm512_mullo_epi32(v, _mm512_set1_epi32(divisorInverse[j]));
+		found |= _mm512_mask_cmple_epu32_mask(active, product, _mm512_set1_epi32(divisorLimit[j]));
+	}
+
+	return found;
+}
+
+/*
+Picks the widest batched kernel the CPU supports.
+*/
+void selectTrialBatch() {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		trialBatch = trialBatchAvx512;
+		batchLanes = 16;
+		fprintf(statusOut, "Using AVX-512 trial division kernel\n");
+	} else if (__builtin_cpu_supports("avx2")) {
+		trialBatch = trialBatchAvx2;
+		batchLanes = 8;
+		fprintf(statusOut, "Using AVX2 trial division kernel\n");
+	} else {
+		trialBatch = trialBatchScalar;
+		batchLanes = 1;
+		fprintf(statusOut, "Using scalar trial division kernel\n");
+	}
+}
+
+/*
+Classifies up to 64 consecutive numbers with the batched kernel and returns a bitmask
+of the composite ones, matching isComposite bit for bit. Numbers that are settled by
+the corner cases or by 2 and 3 are handled directly, numbers too large for 32-bit
+lanes go to isComposite, and the rest are packed into batches.
+*/
+uint64_t classifyWordSimd(const uint64_t * values, int count) {
+	uint64_t bits = 0;
+	uint32_t pending[64 + 16] = {0};
+	int pendingIndex[64];
+	int numPending = 0;
+
+	for (int i = 0; i < count; i++) {
+		uint64_t v = values[i];
+		if (v > UINT32_MAX) {
+			if (isComposite(v))
+				bits |= (uint64_t) 1 << i;
+		} else if (v <= 3) {
+			continue;
+		} else if (v%2 == 0 || v%3 == 0) {
+			STAT_ADD(earlyExits, 1);
+			bits |= (uint64_t) 1 << i;
+		} else {
+			pending[numPending] = (uint32_t) v;
+			pendingIndex[numPending] = i;
+			numPending++;
+		}
+	}
+
+	// The tail of the last batch is left as zero padding
+	for (int b = 0; b < numPending; b += batchLanes) {
+		uint32_t mask = trialBatch(&pending[b]);
+		for (int lane = 0; lane < batchLanes && b + lane < numPending; lane++)
+			if ((mask >> lane) & 1)
+				bits |= (uint64_t) 1 << pendingIndex[b + lane];
+	}
+
+	return bits;
+}
+
+/*
+SplitMix64 finaliser. Applied to seed + i * golden ratio it gives a counter-based
+generator: element i depends only on the seed and i, so any thread can produce any
+part of the array without sharing state.
+*/
+uint64_t splitmix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/*
+Function executed by the generator threads. Each thread fills its own contiguous
+slice of the preallocated array, so the output for a given seed is the same for
+every thread count.
+*/
+void * generateThreadFunction(void * param) {
+	int id = *(int *) (param);
+
+	uint64_t low = 1;
+	for (int i = 1; i < digits; i++)
+		low *= 10;
+	// high - low + 1 = 9 * low for every digit count
+	uint64_t span = 9 * low;
+
+	int64_t first = (int64_t) arrayLength * id / n;
+	int64_t last = (int64_t) arrayLength * (id + 1) / n;
+	STAT_TIMER_START(start);
+
+	for (int64_t i = first; i < last; i++) {
+		uint64_t random = splitmix64(seed + (uint64_t) i * 0x9e3779b97f4a7c15ULL);
+		// Scale into [0, span) with a multiply instead of a modulo
+		numbers[i] = low + (uint64_t) (((unsigned __int128) random * span) >> 64);
+	}
+
+	STAT_TIMER_STOP(generateNanos, start);
+	return NULL;
+}
+
+/*
+Returns zeroed memory whose pages are not yet backed, so each page ends up on the
+NUMA node of the thread that first writes it.
+*/
+void * allocateUntouched(size_t bytes) {
+	void * memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		printf("Error allocating %zu bytes\n", bytes);
+		exit(0);
+	}
+	return memory;
+}
+
+/* Reads a single integer from a sysfs file, or returns -1 if it can't. */
+int readSysfsInt(const char * path) {
+	FILE * file = fopen(path, "r");
+	int value = -1;
+	if (file != NULL) {
+		if (fscanf(file, "%d", &value) != 1)
+			value = -1;
+		fclose(file);
+	}
+	return value;
+}
+
+/*
+Works out the order in which workers are pinned to the CPUs this process may run on.
+Each CPU's NUMA node, package and core come from sysfs. Compact placement sorts by
+node, then core, so workers fill one node (and sibling hyperthreads) before the next.
+Scatter placement takes one CPU of each physical core before any hyperthread sibling,
+and alternates between nodes.
+*/
+void setupPlacement() {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+
+	struct CpuInfo { int cpu; int node; int core; int sibling; int rank; };
+	vector<CpuInfo> cpus;
+	char path[128];
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+
+		CpuInfo info = {cpu, 0, cpu, 0, 0};
+
+		// The node shows up as a nodeN entry in the CPU's sysfs directory
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+		DIR * dir = opendir(path);
+		if (dir != NULL) {
+			struct dirent * entry;
+			while ((entry = readdir(dir)) != NULL)
+				if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4]))
+					info.node = atoi(entry->d_name + 4);
+			closedir(dir);
+		}
+
+		// Number cores uniquely across packages
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		int core = readSysfsInt(path);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		int package = readSysfsInt(path);
+		if (core >= 0 && package >= 0)
+			info.core = package * 65536 + core;
+
+		// Hyperthread siblings of a core get ranks 0, 1, ...
+		for (int i = 0; i < cpus.size(); i++)
+			if (cpus[i].core == info.core)
+				info.sibling++;
+
+		cpus.push_back(info);
+	}
+
+	if (placement == PLACEMENT_COMPACT) {
+		sort(cpus.begin(), cpus.end(), [](const CpuInfo & a, const CpuInfo & b) {
+			if (a.node != b.node) return a.node < b.node;
+			if (a.core != b.core) return a.core < b.core;
+			return a.cpu < b.cpu;
+		});
+	} else {
+		// Rank each CPU among the CPUs of its node at the same sibling level, then take
+		// rank 0 from every node, rank 1 from every node, and so on
+		sort(cpus.begin(), cpus.end(), [](const CpuInfo & a, const CpuInfo & b) {
+			if (a.node != b.node) return a.node < b.node;
+			return a.core < b.core;
+		});
+		for (int i = 0; i < cpus.size(); i++)
+			for (int j = 0; j < i; j++)
+				if (cpus[j].sibling == cpus[i].sibling && cpus[j].node == cpus[i].node)
+					cpus[i].rank++;
+
+		sort(cpus.begin(), cpus.end(), [](const CpuInfo & a, const CpuInfo & b) {
+			if (a.sibling != b.sibling) return a.sibling < b.sibling;
+			if (a.rank != b.rank) return a.rank < b.rank;
+			return a.node < b.node;
+		});
+	}
+
+	int numNodes = 0;
+	for (int i = 0; i < cpus.size(); i++) {
+		cpuOrder.push_back(cpus[i].cpu);
+		if (cpus[i].node + 1 > numNodes)
+			numNodes = cpus[i].node + 1;
+	}
+
+	fprintf(statusOut, "Pinning workers with %s placement over %d CPUs on %d NUMA node(s)\n",
+		placement == PLACEMENT_COMPACT ? "compact" : "scatter", (int) cpus.size(), numNodes);
+}
+
+#ifdef PRIME_STATS
+/*
+Sets up one zeroed stats slot per worker for up to count workers.
+*/
+void setupStats(int count) {
+	numThreadStats = count;
+	threadStats = new ThreadStats[count];
+
+	for (int i = 0; i < count; i++) {
+		threadStats[i].processed = 0;
+		threadStats[i].primes = 0;
+		threadStats[i].divisions = 0;
+		threadStats[i].earlyExits = 0;
+		threadStats[i].wheelExits = 0;
+		threadStats[i].modMultiplies = 0;
+		threadStats[i].generateNanos = 0;
+		threadStats[i].sieveNanos = 0;
+		threadStats[i].classifyNanos = 0;
+	}
+}
+
+/* Numbers classified so far by all workers. */
+uint64_t statsProcessed() {
+	uint64_t total = 0;
+	for (int i = 0; i < numThreadStats; i++)
+		total += threadStats[i].processed.load(memory_order_relaxed);
+	return total;
+}
+
+/*
+Prints the per-thread counters and timers and their totals as a JSON object on
+stderr. Registered with atexit so it runs however the program ends.
+*/
+void printStats() {
+	uint64_t totals[9] = {0};
+
+	fprintf(stderr, "{\"threads\": [\n");
+	for (int i = 0; i < numThreadStats; i++) {
+		ThreadStats * t = &threadStats[i];
+		uint64_t values[9] = {t->processed, t->primes, t->divisions, t->earlyExits, t->wheelExits,
+			t->modMultiplies, t->generateNanos, t->sieveNanos, t->classifyNanos};
+		for (int j = 0; j < 9; j++)
+			totals[j] += values[j];
+
+		fprintf(stderr, "  {\"id\": %d, \"processed\": %llu, \"primes\": %llu, \"divisions\": %llu, "
+			"\"early_exits\": %llu, \"wheel_exits\": %llu, \"mod_multiplies\": %llu, "
+			"\"generate_s\": %.6f, \"sieve_s\": %.6f, \"classify_s\": %.6f}%s\n",
+			i, (unsigned long long) values[0], (unsigned long long) values[1],
+			(unsigned long long) values[2], (unsigned long long) values[3],
+			(unsigned long long) values[4], (unsigned long long) values[5],
+			values[6] / 1e9, values[7] / 1e9, values[8] / 1e9, i + 1 < numThreadStats ? "," : "");
+	}
+	fprintf(stderr, "], \"total\": {\"processed\": %llu, \"primes\": %llu, \"divisions\": %llu, "
+		"\"early_exits\": %llu, \"wheel_exits\": %llu, \"mod_multiplies\": %llu, "
+		"\"generate_s\": %.6f, \"sieve_s\": %.6f, \"classify_s\": %.6f}}\n",
+		(unsigned long long) totals[0], (unsigned long long) totals[1],
+		(unsigned long long) totals[2], (unsigned long long) totals[3],
+		(unsigned long long) totals[4], (unsigned long long) totals[5],
+		totals[6] / 1e9, totals[7] / 1e9, totals[8] / 1e9);
+}
+
+/*
+Progress thread. Prints the numbers classified so far, and the rate, every
+progressInterval seconds until progressStop is posted.
+*/
+void * progressFunction(void * param) {
+	double start = now();
+	struct timespec deadline;
+
+	while (true) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t) progressInterval;
+		deadline.tv_nsec += (long) ((progressInterval - (time_t) progressInterval) * 1e9);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (sem_timedwait(&progressStop, &deadline) == 0)
+			break;
+
+		uint64_t done = statsProcessed();
+		double elapsed = now() - start;
+		if (progressTotal > 0)
+			fprintf(stderr, "Progress: %llu/%lld numbers (%.1f%%), %.0f numbers/s\n",
+				(unsigned long long) done, (long long) progressTotal, done * 100.0 / progressTotal, done / elapsed);
+		else
+			fprintf(stderr, "Progress: %llu numbers, %.0f numbers/s\n", (unsigned long long) done, done / elapsed);
+	}
+
+	pthread_exit(0);
+}
+#endif
+
+/*
+Body of every pool worker. Waits to be started, runs the current task with its id and
+reports back, until it is started with no task.
+*/
+void * poolWorker(void * param) {
+	int id = *(int *) (param);
+
+#ifdef PRIME_STATS
+	if (id < numThreadStats)
+		myStats = &threadStats[id];
+#endif
+
+	while (true) {
+		sem_wait(&poolStart[id]);
+		if (poolTask == NULL)
+			break;
+		poolTask(param);
+		sem_post(&poolDone);
+	}
+
+	pthread_exit(0);
+}
+
+/*
+Starts n pool workers. With a placement policy, worker i is pinned through its thread
+attributes to the ith CPU in cpuOrder (wrapping if there are more workers than CPUs).
+*/
+void createPool() {
+	poolSize = n;
+	poolThreads = new pthread_t[n];
+	poolIDs = new int[n];
+	poolStart = new sem_t[n];
+	sem_init(&poolDone, 0, 0);
+
+	if (placement != PLACEMENT_NONE && cpuOrder.empty())
+		setupPlacement();
+
+	pthread_attr_t attrs[n];
+
+	for (int i = 0; i < n; i++) {
+		poolIDs[i] = i;
+		sem_init(&poolStart[i], 0, 0);
+		pthread_attr_init(&attrs[i]);
+
+		if (placement != PLACEMENT_NONE && !cpuOrder.empty()) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpuOrder[i % cpuOrder.size()], &cpus);
+			pthread_attr_setaffinity_np(&attrs[i], sizeof(cpus), &cpus);
+		}
+
+		if (pthread_create(&poolThreads[i], &attrs[i], poolWorker, &poolIDs[i]) != 0) {
+			printf("Error creating worker thread %d\n", i);
+			exit(0);
+		}
+		pthread_attr_destroy(&attrs[i]);
+	}
+}
+
+/* Stops and joins every pool worker. */
+void destroyPool() {
+	poolTask = NULL;
+	for (int i = 0; i < poolSize; i++)
+		sem_post(&poolStart[i]);
+	for (int i = 0; i < poolSize; i++) {
+		pthread_join(poolThreads[i], NULL);
+		sem_destroy(&poolStart[i]);
+	}
+	sem_destroy(&poolDone);
+
+	delete[] poolThreads;
+	delete[] poolIDs;
+	delete[] poolStart;
+	poolSize = 0;
+}
+
+/* Runs task on every pool worker and waits until they have all finished. */
+void runOnPool(void * (*task)(void *)) {
+	poolTask = task;
+	for (int i = 0; i < poolSize; i++)
+		sem_post(&poolStart[i]);
+	for (int i = 0; i < poolSize; i++)
+		sem_wait(&poolDone);
+}
+
 /* Generates a random array
- of size ARR_SIZE, where every element
- is a 9-digit int.
+ of size arrayLength (ARR_SIZE by default), where every element
+ is a number with the given digit count (9 by default, up to 19).
+ The n threads each generate part of it.
 */
 void generateArray() {
 
-    int randomNum;
-	srand(time(NULL));
+	fprintf(statusOut, "Generating random array...\n");
 
-	printf("Generating random array...\n");
+	numbers = (uint64_t *) allocateUntouched((size_t) arrayLength * sizeof(uint64_t));
 
-	for (int i = 0; i < ARR_SIZE; i++) {
-		// random 9-digit number
-		randomNum = abs(100000000 + rand() % (999999999 - 100000000 + 1));
-		numbers.push_back(randomNum);
-	}
+	runOnPool(generateThreadFunction);
 
-	printf("Size of array: %d\n", ARR_SIZE);
+	fprintf(statusOut, "Size of array: %d\n", arrayLength);
 
 	return;
 }
 
 /*
-Function executed by the computation threads. They loop through the array and
-determine whether the numbers they are assigned are composite or not. The results
-are stored in a global array.
+Function executed by the sieve threads before classification. Segments "leapfrog"
+over other threads, so each thread sieves every nth segment that holds an input into
+its own buffer, and records which of that segment's inputs are composite.
+*/
+void * sieveThreadFunction(void * param) {
+	int id = *(int *) (param);
+	uint64_t bits[SEGMENT_BITS / 64];
+
+	STAT_TIMER_START(start);
+
+	for (size_t i = id; i < sieveSegments.size(); i += n) {
+		// Crossing out p costs about SEGMENT_BITS / p bit operations, while testing the
+		// segment's inputs for it costs at most one division each, and most inputs are
+		// settled by the first few primes. So the primes below SEGMENT_BITS / lookups
+		// are tested directly and only the larger ones are crossed out.
+		int lookups = segmentStart[i + 1] - segmentStart[i];
+		uint64_t cutoff = SEGMENT_BITS / lookups;
+		int crossFrom = lower_bound(basePrimes.begin(), basePrimes.end(), cutoff) - basePrimes.begin();
+
+		sieveSegment(sieveSegments[i], bits, crossFrom);
+
+		uint64_t first = sieveSegments[i] * SEGMENT_BITS;
+		for (int j = segmentStart[i]; j < segmentStart[i + 1]; j++) {
+			int index = segmentInputs[j];
+			uint64_t v = blockValues[index];
+
+			bool composite = false;
+			for (int q = 0; q < crossFrom && basePrimes[q] * basePrimes[q] <= v; q++) {
+				if (v % basePrimes[q] == 0) {
+					composite = true;
+					break;
+				}
+			}
+
+			uint64_t k = (v - sieveLow) / 2 - first;
+			if (!composite)
+				composite = (bits[k >> 6] >> (k & 63)) & 1;
+
+			// Neighbouring inputs can be in segments sieved by other threads
+			if (composite)
+				sieveComposite[index / 64].fetch_or((uint64_t) 1 << (index & 63), memory_order_relaxed);
+		}
+	}
+
+	STAT_TIMER_STOP(sieveNanos, start);
+	return NULL;
+}
+
+/*
+Classifies a single number with the selected kernel.
+*/
+bool classify(uint64_t number) {
+	switch (kernel) {
+		case KERNEL_MR:
+			return isCompositeMR(number);
+		default:
+			return isComposite(number);
+	}
+}
+
+/*
+Creates one queue per thread. The counters in each queue add up over every block.
+*/
+void setupQueues() {
+	delete[] queues;
+	queues = new WorkQueue[n];
+
+	for (int i = 0; i < n; i++) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].head = 0;
+		queues[i].tail = 0;
+		queues[i].busySeconds = 0;
+		queues[i].chunksDone = 0;
+		queues[i].chunksStolen = 0;
+		queues[i].numPrime = 0;
+		queues[i].numComp = 0;
+		queues[i].cacheHits = 0;
+		queues[i].cacheMisses = 0;
+	}
+}
+
+/*
+Stores an entry in the cache, replacing another entry if its probe run is full.
+Returns false if it was already there.
+*/
+bool cacheInsert(uint64_t entry) {
+	uint64_t hash = splitmix64(entry >> 1);
+	uint64_t slot = hash & (cacheCapacity - 1);
+
+	for (int probe = 0; probe < CACHE_MAX_PROBE; probe++) {
+		atomic<uint64_t> * cell = &cacheTable[(slot + probe) & (cacheCapacity - 1)];
+		uint64_t current = cell->load(memory_order_relaxed);
+
+		if (current == 0 && cell->compare_exchange_strong(current, entry, memory_order_relaxed))
+			return true;
+		// Either the slot was taken or another thread just filled it
+		if (current >> 1 == entry >> 1)
+			return false;
+	}
+
+	// The top bits of the hash pick the victim, which the slot index doesn't use
+	uint64_t victim = (slot + (hash >> 60) % CACHE_MAX_PROBE) & (cacheCapacity - 1);
+	cacheTable[victim].store(entry, memory_order_relaxed);
+	return true;
+}
+
+/*
+Looks a number up in the cache. Returns 1 if it is cached as composite, 0 if cached
+as not composite and -1 if it is not cached.
+*/
+int cacheLookup(uint64_t number) {
+	uint64_t slot = splitmix64(number) & (cacheCapacity - 1);
+
+	for (int probe = 0; probe < CACHE_MAX_PROBE; probe++) {
+		uint64_t current = cacheTable[(slot + probe) & (cacheCapacity - 1)].load(memory_order_relaxed);
+		if (current == 0)
+			return -1;
+		if (current >> 1 == number)
+			return current & 1;
+	}
+	return -1;
+}
+
+/* Header at the start of a cache file, followed by count entries */
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entryBytes;
+	uint64_t count;
+};
+
+/*
+Allocates the primality cache with at least capacity entries (rounded up to a power
+of two), and loads the entries saved in cachePath if there is one. A file without
+the cache header, of another version or entry size, or whose length doesn't match
+its entry count is ignored and left as it is, and the run starts cold.
+*/
+void setupCache(uint64_t capacity) {
+	cacheCapacity = 1;
+	while (cacheCapacity < capacity)
+		cacheCapacity *= 2;
+
+	cacheTable = new atomic<uint64_t>[cacheCapacity];
+	for (uint64_t i = 0; i < cacheCapacity; i++)
+		cacheTable[i].store(0, memory_order_relaxed);
+
+	if (cachePath == NULL)
+		return;
+
+	FILE * file = fopen(cachePath, "rb");
+	if (file == NULL)
+		return;
+
+	CacheHeader header;
+	struct stat st;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CACHE_MAGIC, 8) != 0
+		|| header.version != CACHE_VERSION || header.entryBytes != sizeof(uint64_t)
+		|| fstat(fileno(file), &st) == -1
+		|| (uint64_t) st.st_size != sizeof(header) + header.count * sizeof(uint64_t)) {
+		// Whatever the file is, it isn't ours to overwrite at exit
+		fprintf(stderr, "%s is not a valid cache file, starting with an empty cache that won't be saved\n",
+			cachePath);
+		fclose(file);
+		cachePath = NULL;
+		return;
+	}
+
+	uint64_t entries[4096];
+	size_t count;
+	uint64_t loaded = 0;
+	while ((count = fread(entries, sizeof(uint64_t), 4096, file)) > 0) {
+		for (size_t i = 0; i < count; i++)
+			if (cacheInsert(entries[i]))
+				loaded++;
+	}
+	fclose(file);
+
+	printf("Loaded %llu cached results from %s\n", (unsigned long long) loaded, cachePath);
+}
+
+/*
+Writes every cached entry to cachePath so the next run can start warm.
+*/
+void saveCache() {
+	FILE * file = fopen(cachePath, "wb");
+	if (file == NULL) {
+		printf("Error writing cache file %s\n", cachePath);
+		return;
+	}
+
+	CacheHeader header;
+	memcpy(header.magic, CACHE_MAGIC, 8);
+	header.version = CACHE_VERSION;
+	header.entryBytes = sizeof(uint64_t);
+	header.count = 0;
+	for (uint64_t i = 0; i < cacheCapacity; i++)
+		if (cacheTable[i].load(memory_order_relaxed) != 0)
+			header.count++;
+	fwrite(&header, sizeof(header), 1, file);
+
+	uint64_t saved = 0;
+	for (uint64_t i = 0; i < cacheCapacity && saved < header.count; i++) {
+		uint64_t entry = cacheTable[i].load(memory_order_relaxed);
+		if (entry != 0) {
+			fwrite(&entry, sizeof(uint64_t), 1, file);
+			saved++;
+		}
+	}
+	fclose(file);
+
+	printf("Saved %llu cached results to %s\n", (unsigned long long) saved, cachePath);
+}
+
+/*
+Gives each thread an equal, contiguous run of the current block's chunks.
+*/
+void fillQueues() {
+	numChunks = (blockSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	for (int i = 0; i < n; i++) {
+		queues[i].head = (int) ((int64_t) numChunks * i / n);
+		queues[i].tail = (int) ((int64_t) numChunks * (i + 1) / n);
+	}
+}
+
+/*
+Takes the next chunk for thread id. The thread's own queue is used first; once it
+is empty, the other queues are scanned and half of the first non-empty one is moved
+over. Returns false when there is no work left anywhere.
+*/
+bool takeChunk(int id, int * chunk) {
+	WorkQueue * own = &queues[id];
+
+	pthread_mutex_lock(&own->lock);
+	if (own->head < own->tail) {
+		*chunk = own->head++;
+		pthread_mutex_unlock(&own->lock);
+		return true;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	for (int offset = 1; offset < n; offset++) {
+		WorkQueue * victim = &queues[(id + offset) % n];
+
+		pthread_mutex_lock(&victim->lock);
+		int available = victim->tail - victim->head;
+		if (available == 0) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		// Steal the back half, rounded up so a single chunk can still be taken
+		int stolenTail = victim->tail;
+		victim->tail -= (available + 1) / 2;
+		int stolenHead = victim->tail;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&own->lock);
+		own->head = stolenHead + 1;
+		own->tail = stolenTail;
+		own->chunksStolen += stolenTail - stolenHead;
+		pthread_mutex_unlock(&own->lock);
+
+		*chunk = stolenHead;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+Classifies up to 64 consecutive numbers with the selected kernel and returns a bitmask
+of the composite ones.
+*/
+uint64_t classifyWord(const uint64_t * values, int count) {
+	if (kernel == KERNEL_SIMD)
+		return classifyWordSimd(values, count);
+
+	uint64_t bits = 0;
+	for (int i = 0; i < count; i++)
+		if (classify(values[i]))
+			bits |= (uint64_t) 1 << i;
+	return bits;
+}
+
+/*
+Same as classifyWord, but answers what it can from the cache first. The misses are
+classified together, so the SIMD kernel still gets full batches, and then added to
+the cache. Numbers of 2^63 and above don't fit in an entry and are never cached.
+*/
+uint64_t classifyWordCached(const uint64_t * values, int count, WorkQueue * queue) {
+	uint64_t bits = 0;
+	uint64_t misses[64];
+	int missIndex[64];
+	int numMisses = 0;
+
+	for (int i = 0; i < count; i++) {
+		int cached = values[i] >> 63 ? -1 : cacheLookup(values[i]);
+		if (cached == 1) {
+			bits |= (uint64_t) 1 << i;
+		} else if (cached == -1) {
+			misses[numMisses] = values[i];
+			missIndex[numMisses] = i;
+			numMisses++;
+		}
+	}
+
+	queue->cacheHits += count - numMisses;
+	queue->cacheMisses += numMisses;
+	if (numMisses == 0)
+		return bits;
+
+	uint64_t missBits = classifyWord(misses, numMisses);
+	for (int j = 0; j < numMisses; j++) {
+		uint64_t composite = (missBits >> j) & 1;
+		bits |= composite << missIndex[j];
+		if (misses[j] != 0 && !(misses[j] >> 63))
+			cacheInsert(misses[j] << 1 | composite);
+	}
+
+	return bits;
+}
+
+/*
+Function executed by the computation threads. Each thread works through contiguous
+chunks of the array, stealing chunks from other threads once its own run is done,
+and determines whether the numbers are composite or not. The results are stored in
+a global bitmap one 64-bit word at a time, and the thread keeps its own counts of
+primes and composites.
 */
 void * threadFunction(void * param) {
 	int id = *(int *) (param);
 
-	int index;
-	int counter = 0;
+	int chunk;
+
+	while (takeChunk(id, &chunk)) {
+		double start = now();
+
+		int first = chunk * CHUNK_SIZE;
+		int last = first + CHUNK_SIZE;
+		if (last > blockSize) last = blockSize;
+
+		// Determine composite or not for 64 numbers at a time, then store the whole word
+		int composites = 0;
+		for (int word = first; word < last; word += 64) {
+			uint64_t bits;
+			int wordEnd = word + 64 < last ? word + 64 : last;
+			// The sieve has answered the whole block already, so there is nothing to cache
+			if (kernel == KERNEL_SIEVE)
+				bits = sieveComposite[word / 64].load(memory_order_relaxed);
+			else if (cacheCapacity > 0)
+				bits = classifyWordCached(&blockValues[word], wordEnd - word, &queues[id]);
+			else
+				bits = classifyWord(&blockValues[word], wordEnd - word);
+			results[word / 64] = bits;
+			composites += __builtin_popcountll(bits);
+		}
+
+		queues[id].numComp += composites;
+		queues[id].numPrime += (last - first) - composites;
+		queues[id].busySeconds += now() - start;
+		queues[id].chunksDone++;
+
+		STAT_ADD(processed, last - first);
+		STAT_ADD(primes, (last - first) - composites);
+		STAT_ADD(classifyNanos, (uint64_t) ((now() - start) * 1e9));
+	}
+
+	return NULL;
+}
+
+/*
+Classifies count numbers with the n pool workers and stores the result bitmap in
+bits. The per-thread counts in queues are added to.
+*/
+void classifyBlock(const uint64_t * values, int count, uint64_t * bits) {
+	blockValues = values;
+	blockSize = count;
+	results = bits;
+
+	// Sieve the input range first so the computation threads only do lookups
+	if (kernel == KERNEL_SIEVE && !setupSieve()) {
+		fprintf(stderr, "Input range too wide for the sieve, using Miller-Rabin instead\n");
+		kernel = KERNEL_MR;
+	}
+
+	if (kernel == KERNEL_SIEVE)
+		runOnPool(sieveThreadFunction);
+
+	// Chunk i of the block lands on the same worker as slice i of the generated array
+	fillQueues();
+	runOnPool(threadFunction);
+}
+
+/*
+Opens the input for the pipeline. A binary file of native-endian uint64_t values is
+memory-mapped; "-" leaves stdin to be parsed as newline-delimited text.
+*/
+void openInput() {
+	if (strcmp(inputPath, "-") == 0)
+		return;
+
+	int fd = open(inputPath, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		printf("Error opening input file %s\n", inputPath);
+		exit(0);
+	}
+
+	inputMapCount = st.st_size / sizeof(uint64_t);
+	if (inputMapCount > 0) {
+		void * map = mmap(NULL, inputMapCount * sizeof(uint64_t), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			printf("Error memory-mapping input file %s\n", inputPath);
+			exit(0);
+		}
+		madvise(map, inputMapCount * sizeof(uint64_t), MADV_SEQUENTIAL);
+		inputMap = (const uint64_t *) map;
+	}
+	close(fd);
+}
+
+/*
+Pipeline reader thread. Fills empty blocks in order, either by pointing them at the
+next part of the mapped file (and asking the kernel to read it ahead) or by parsing
+the next lines of stdin, until the input runs out. Then posts an empty block.
+*/
+void * readerFunction(void * param) {
+	size_t offset = 0;
+	int slot = 0;
+
+	while (true) {
+		sem_wait(&blocksEmpty);
+		Block * block = &blocks[slot];
+
+		if (inputMap != NULL || strcmp(inputPath, "-") != 0) {
+			size_t count = inputMapCount - offset;
+			if (count > BLOCK_SIZE) count = BLOCK_SIZE;
+			block->values = inputMap + offset;
+			block->count = count;
+			if (count > 0)
+				madvise((void *) ((uintptr_t) block->values & ~(uintptr_t) 4095),
+					count * sizeof(uint64_t) + 4096, MADV_WILLNEED);
+			offset += count;
+		} else {
+			int count = 0;
+			unsigned long long value;
+			while (count < BLOCK_SIZE && scanf("%llu", &value) == 1)
+				block->buffer[count++] = value;
+			block->values = block->buffer;
+			block->count = count;
+		}
+
+		bool last = block->count == 0;
+		sem_post(&blocksFull);
+		if (last)
+			break;
+		slot = (slot + 1) % NUM_BLOCKS;
+	}
+
+	pthread_exit(0);
+}
+
+/*
+Pipeline writer thread. Appends each finished block's result bitmap to the output
+file, if there is one, releases the mapped pages it no longer needs and hands the
+slot back to the reader.
+*/
+void * writerFunction(void * param) {
+	FILE * out = (FILE *) param;
+	int slot = 0;
 
 	while (true) {
-		// Indexes "leapfrog" over other threads
-		index = n * counter + id;
-		if (index >= numbers.size())
+		sem_wait(&blocksDone);
+		Block * block = &blocks[slot];
+		if (block->count == 0)
 			break;
-		// Determine composite or not and store in global array
-		isComposite(numbers.at(index))? results[index] = true : results[index] = false;
-		counter++;
+
+		if (out != NULL)
+			fwrite(block->bits, sizeof(uint64_t), (block->count + 63) / 64, out);
+
+		if (inputMap != NULL) {
+			uintptr_t first = ((uintptr_t) block->values + 4095) & ~(uintptr_t) 4095;
+			uintptr_t last = (uintptr_t) (block->values + block->count) & ~(uintptr_t) 4095;
+			if (last > first)
+				madvise((void *) first, last - first, MADV_DONTNEED);
+		}
+
+		sem_post(&blocksEmpty);
+		slot = (slot + 1) % NUM_BLOCKS;
 	}
 
 	pthread_exit(0);
 }
 
+/*
+Runs the input through a three-stage pipeline: the reader thread loads block k+1
+while the computation threads classify block k and the writer thread stores block
+k-1. Memory use is bounded by NUM_BLOCKS blocks whatever the input size.
+*/
+void runPipeline() {
+	openInput();
+
+	FILE * out = NULL;
+	if (outputPath != NULL) {
+		out = fopen(outputPath, "wb");
+		if (out == NULL) {
+			printf("Error opening output file %s\n", outputPath);
+			exit(0);
+		}
+	}
+
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		blocks[i].buffer = (uint64_t *) malloc(BLOCK_SIZE * sizeof(uint64_t));
+		blocks[i].bits = (uint64_t *) malloc((BLOCK_SIZE / 64) * sizeof(uint64_t));
+	}
+
+	sem_init(&blocksEmpty, 0, NUM_BLOCKS);
+	sem_init(&blocksFull, 0, 0);
+	sem_init(&blocksDone, 0, 0);
+
+	pthread_t reader;
+	pthread_t writer;
+	pthread_create(&reader, NULL, readerFunction, NULL);
+	pthread_create(&writer, NULL, writerFunction, out);
+
+	printf("Streaming input from %s...\n", strcmp(inputPath, "-") == 0 ? "stdin" : inputPath);
+
+	int64_t total = 0;
+	int slot = 0;
+	while (true) {
+		sem_wait(&blocksFull);
+		Block * block = &blocks[slot];
+		// The slot may be refilled as soon as it is posted, so read the count first
+		int count = block->count;
+
+		if (count > 0) {
+			classifyBlock(block->values, count, block->bits);
+			total += count;
+		}
+
+		sem_post(&blocksDone);
+		if (count == 0)
+			break;
+		slot = (slot + 1) % NUM_BLOCKS;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	if (out != NULL)
+		fclose(out);
+
+	printf("Numbers read: %lld\n", (long long) total);
+}
+
+/*
+Times classifyBlock on the first size numbers with the current kernel and n threads.
+Runs benchWarmups untimed passes first and returns the median of benchRepetitions
+timed passes, in seconds.
+*/
+double timeConfiguration(int size) {
+	Kernel requested = kernel;
+	vector<double> times;
+
+	setupQueues();
+	createPool();
+
+	for (int rep = 0; rep < benchWarmups + benchRepetitions; rep++) {
+		// A sieve fallback switches the kernel, so restore it every pass
+		kernel = requested;
+
+		double start = now();
+		classifyBlock(numbers, size, results);
+		double elapsed = now() - start;
+
+		if (rep >= benchWarmups)
+			times.push_back(elapsed);
+	}
+
+	destroyPool();
+
+	kernel = requested;
+	sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+/*
+Benchmark mode. Sweeps kernels (every kernel, or just the one given with -k), input
+sizes (arrayLength/100, arrayLength/10 and arrayLength) and thread counts (powers of
+two up to n, plus n) and prints one row per configuration as CSV or JSON. Speedup
+and parallel efficiency are relative to the 1-thread run of the same kernel and size.
+The array is generated once at full size; with the counter-based generator, each
+smaller size is exactly the array that -N would generate for it.
+*/
+void runBenchmark(bool allKernels) {
+	int maxThreads = n;
+	createPool();
+	generateArray();
+	destroyPool();
+	results = (uint64_t *) allocateUntouched(((arrayLength + 63) / 64) * sizeof(uint64_t));
+
+	setupDivisorTables();
+	selectTrialBatch();
+
+	vector<int> threadCounts;
+	for (int t = 1; t < maxThreads; t *= 2)
+		threadCounts.push_back(t);
+	threadCounts.push_back(maxThreads);
+
+	vector<int> sizes;
+	for (int divisor = 100; divisor >= 1; divisor /= 10)
+		if (arrayLength / divisor >= 1 && (sizes.empty() || sizes.back() != arrayLength / divisor))
+			sizes.push_back(arrayLength / divisor);
+
+	bool json = strcmp(benchFormat, "json") == 0;
+	bool first = true;
+	if (json)
+		printf("[\n");
+	else
+		printf("kernel,size,threads,wall_seconds,numbers_per_second,speedup,efficiency\n");
+
+	for (int k = 0; k < NUM_KERNELS; k++) {
+		if (!allKernels && k != kernel)
+			continue;
+
+		for (int s = 0; s < sizes.size(); s++) {
+			double baseline = 0;
+
+			for (int t = 0; t < threadCounts.size(); t++) {
+				kernel = (Kernel) k;
+				n = threadCounts[t];
+
+				double seconds = timeConfiguration(sizes[s]);
+				if (n == 1)
+					baseline = seconds;
+				double speedup = baseline / seconds;
+
+				if (json) {
+					printf("%s  {\"kernel\": \"%s\", \"size\": %d, \"threads\": %d, \"wall_seconds\": %.6f, "
+						"\"numbers_per_second\": %.0f, \"speedup\": %.3f, \"efficiency\": %.3f}",
+						first ? "" : ",\n", kernelNames[k], sizes[s], n, seconds, sizes[s] / seconds,
+						speedup, speedup / n);
+				} else {
+					printf("%s,%d,%d,%.6f,%.0f,%.3f,%.3f\n", kernelNames[k], sizes[s], n, seconds,
+						sizes[s] / seconds, speedup, speedup / n);
+				}
+				first = false;
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+}
+
 /*
 Main thread that creates the other threads, then calculates the proportions prime/composite
 based on the thread results.
 */
 int main(int argc, char * argv[])
 {
-	generateArray();
+	// Get the kernel, input and generator settings from the options
+	int opt;
+	bool kernelChosen = false;
+	uint64_t cacheEntries = 0;
+	seed = time(NULL);
+	while ((opt = getopt(argc, argv, "k:d:f:o:s:N:b:r:w:p:P:c:C:")) != -1) {
+		if (opt == 'k' && strcmp(optarg, "trial") == 0) {
+			kernel = KERNEL_TRIAL;
+			kernelChosen = true;
+		} else if (opt == 'k' && strcmp(optarg, "sieve") == 0) {
+			kernel = KERNEL_SIEVE;
+			kernelChosen = true;
+		} else if (opt == 'k' && strcmp(optarg, "mr") == 0) {
+			kernel = KERNEL_MR;
+			kernelChosen = true;
+		} else if (opt == 'k' && strcmp(optarg, "simd") == 0) {
+			kernel = KERNEL_SIMD;
+			kernelChosen = true;
+		} else if (opt == 'b' && (strcmp(optarg, "csv") == 0 || strcmp(optarg, "json") == 0)) {
+			benchFormat = optarg;
+		} else if (opt == 'p' && strcmp(optarg, "none") == 0) {
+			placement = PLACEMENT_NONE;
+		} else if (opt == 'p' && strcmp(optarg, "compact") == 0) {
+			placement = PLACEMENT_COMPACT;
+		} else if (opt == 'p' && strcmp(optarg, "scatter") == 0) {
+			placement = PLACEMENT_SCATTER;
+		} else if (opt == 'P' && atof(optarg) > 0) {
+#ifdef PRIME_STATS
+			progressInterval = atof(optarg);
+#else
+			printf("Progress lines need a build with -DPRIME_STATS\n");
+#endif
+		} else if (opt == 'c') {
+			cachePath = optarg;
+		} else if (opt == 'C' && strtoull(optarg, NULL, 10) >= 1) {
+			cacheEntries = strtoull(optarg, NULL, 10);
+		} else if (opt == 'r' && atoi(optarg) >= 1) {
+			benchRepetitions = atoi(optarg);
+		} else if (opt == 'w' && atoi(optarg) >= 0) {
+			benchWarmups = atoi(optarg);
+		} else if (opt == 'd' && atoi(optarg) >= 1 && atoi(optarg) <= 19) {
+			digits = atoi(optarg);
+		} else if (opt == 'f') {
+			inputPath = optarg;
+		} else if (opt == 'o') {
+			outputPath = optarg;
+		} else if (opt == 's') {
+			seed = strtoull(optarg, NULL, 10);
+		} else if (opt == 'N' && atoi(optarg) >= 1) {
+			arrayLength = atoi(optarg);
+		} else {
+			printf("Usage: %s [-k trial|sieve|mr|simd] [-d digits] [-f file|-] [-o file] [-s seed] [-N count] [-b csv|json] [-r reps] [-w warmups] [-p none|compact|scatter] [-P seconds] [-c cachefile] [-C entries] n\n", argv[0]);
+			exit(0);
+		}
+	}
 
 	// Get n from command line
-	if (argc != 2) {
+	if (argc - optind != 1) {
 		printf("Enter n through command line\n");
 		exit(0);
 	}
 
-	n = abs(stoi(argv[1]));
+	n = abs(stoi(argv[optind]));
+	if (n == 0) {
+		printf("n must be at least 1\n");
+		exit(0);
+	}
 
-	arraySize = numbers.size();
-	results = (bool *) malloc(arraySize);
+#ifdef PRIME_STATS
+	setupStats(n);
+	atexit(printStats);
+#endif
 
-	// Create n threads
-	int threadIDs[n];
-	pthread_t tid[n];
-    pthread_attr_t attrs[n];
+	if (benchFormat != NULL) {
+		statusOut = stderr;
+		runBenchmark(!kernelChosen);
+		return 0;
+	}
 
-	for (int i = 0; i < n; i++) {
-		threadIDs[i] = i;
-		pthread_attr_init(&attrs[i]);
-        pthread_create(&tid[i], &attrs[i], threadFunction, &threadIDs[i]);
+#ifdef PRIME_STATS
+	pthread_t progress;
+	if (progressInterval > 0) {
+		progressTotal = inputPath == NULL ? arrayLength : 0;
+		sem_init(&progressStop, 0, 0);
+		pthread_create(&progress, NULL, progressFunction, NULL);
 	}
+#endif
 
-	for (int i = 0; i < n; i++) {
-		pthread_join(tid[i], NULL);
+	if (kernel == KERNEL_SIMD) {
+		setupDivisorTables();
+		selectTrialBatch();
 	}
 
-	int numPrime = 0;
-	int numComp = 0;
-	// print the results
-	for (int i = 0; i < numbers.size(); i++) {
-		//results[i] == true? cout << numbers.at(i) << " is a composite number" << endl : cout << numbers.at(i) << " is a prime number" << endl;
-		if (results[i] == true)	{
-			numComp++;
-		}
-		else {
-			numPrime++;
+	setupQueues();
+	createPool();
+
+	if (cacheEntries > 0 || cachePath != NULL)
+		setupCache(cacheEntries > 0 ? cacheEntries : CACHE_DEFAULT_CAPACITY);
+
+	if (inputPath != NULL) {
+		runPipeline();
+	} else {
+		generateArray();
+
+		arraySize = arrayLength;
+		results = (uint64_t *) allocateUntouched(((arraySize + 63) / 64) * sizeof(uint64_t));
+
+		classifyBlock(numbers, arraySize, results);
+
+		if (outputPath != NULL) {
+			FILE * out = fopen(outputPath, "wb");
+			if (out != NULL) {
+				fwrite(results, sizeof(uint64_t), (arraySize + 63) / 64, out);
+				fclose(out);
+			}
 		}
 	}
+
+	destroyPool();
+
+#ifdef PRIME_STATS
+	if (progressInterval > 0) {
+		sem_post(&progressStop);
+		pthread_join(progress, NULL);
+	}
+#endif
+
+	// Merge the per-thread counts
+	int64_t numPrime = 0;
+	int64_t numComp = 0;
+	for (int i = 0; i < n; i++) {
+		numPrime += queues[i].numPrime;
+		numComp += queues[i].numComp;
+	}
 	// Print proportions
-	int total = numPrime + numComp;
+	int64_t total = numPrime + numComp;
 	double propPrime = ((double) numPrime * 100) / ((double) total);
 	double propComp = ((double) numComp * 100) / ((double) total);
 
 	printf("\nProportion prime: %.2f%\nProportion composite: %.2f%\n\n", propPrime, propComp);
 
+	// Print how busy each thread was, to show how evenly the work was spread
+	for (int i = 0; i < n; i++) {
+		printf("Thread %d: busy %.3f s, %d chunks (%d stolen)\n", i, queues[i].busySeconds,
+			queues[i].chunksDone, queues[i].chunksStolen);
+	}
+	printf("\n");
+
+	if (cacheCapacity > 0) {
+		int64_t hits = 0;
+		int64_t misses = 0;
+		for (int i = 0; i < n; i++) {
+			hits += queues[i].cacheHits;
+			misses += queues[i].cacheMisses;
+		}
+		uint64_t entries = 0;
+		for (uint64_t i = 0; i < cacheCapacity; i++)
+			if (cacheTable[i].load(memory_order_relaxed) != 0)
+				entries++;
+
+		printf("Cache: %lld hits, %lld misses (%.1f%% hit rate), %llu/%llu entries\n",
+			(long long) hits, (long long) misses, hits * 100.0 / (hits + misses > 0 ? hits + misses : 1),
+			(unsigned long long) entries, (unsigned long long) cacheCapacity);
+
+		if (cachePath != NULL)
+			saveCache();
+		printf("\n");
+	}
+
 	return 0;
 }
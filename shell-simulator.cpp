@@ -1,286 +1,3018 @@
 /* 
-This program simulates a simple linux shell. It loops infinitely, prompting the user for commands. Regular commands and piping/redirection
-are handled with the system() call, while the "&" feature is manually implemented to allow for commands to run in the background. Special
-piping uses the $ symbol and aggregates the output of the left-side commands to be the input of each right-side command.
+This program simulates a simple linux shell. It loops infinitely, prompting the user for commands. Regular commands are parsed into
+pipelines and run natively: piping, redirection and the "&" background feature are set up with pipe() and posix_spawn() file actions,
+so each stage costs a single process creation and no /bin/sh. Special piping uses the $ symbol and aggregates the output of the
+left-side commands to be the input of each right-side command. Each side holds any number of commands, separated by commas
+when they take arguments ("ls -l, pwd $ wc -l, sort"). Words may be quoted with '' or "" and characters escaped with \,
+and unquoted *, ? and [ match file names as in /bin/sh. Other /bin/sh features, such as variables, ~, ; and &&, are not
+supported.
+Background commands are kept in a job table and reaped on SIGCHLD; the jobs, wait and fg builtins manage them. Command
+names are looked up on PATH once and cached, and "hash" shows the cache. The builtins cd, pwd, echo, exit, jobs, wait, fg,
+hash and times run inside the shell unless they are part of a pipeline.
+Every process is reaped with wait4(), and its times, max RSS, context switches and exit code are kept. A command line that
+starts with "time" prints them for each process and the whole command, "times" prints the session totals, and -l appends
+one JSON record per command to a log; $ commands also report the bytes fanned out and how often the relay waited. -p sets
+the capacity of every pipe the shell creates. -b benchmarks the ways of launching commands instead of running any.
+Interactive commands are appended to a history file, which is mapped rather than read at startup, as is the prefix
+index saved beside it in a .idx file. "history" lists the latest commands, "history -p" lists those with a prefix, and
+!! or !prefix runs the latest matching command again.
+Given a script file, or - for stdin, the shell runs in batch mode instead: up to -j lines run at once, and the exit code
+of each line is reported in order once they have all finished.
 */
 
 #include<iostream>
 #include<cstring>
 #include<vector>
 #include<string>
+#include<string_view>
+#include<fstream>
+#include<unordered_map>
+#include<algorithm>
+#include <stdlib.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #define READ 0
 #define WRITE 1
 
+// What spawnStage() returns instead of a pid when a redirection file can't be opened, as opposed to -1 when the
+// command itself can't be run
+#define REDIRECT_FAILED -2
+
+// Most bytes moved from the left-side pipe per fan-out round, unless -p makes the pipes bigger
+#define FANOUT_CHUNK (64 * 1024)
+
+// Most background jobs running at once; a further "&" command waits for one of them to finish
+#define MAX_JOBS 64
+
+// Entries the history builtin lists without a count
+#define HISTORY_LIST 16
+
+// History index file: its header, and how far the history may grow past it before it is rebuilt
+#define HISTORY_INDEX_MAGIC "SHHISTIX"
+#define HISTORY_INDEX_VERSION 1
+#define HISTORY_INDEX_SLACK (1 << 20)
+
+// Bytes at the end of the indexed part of the history that the index file keeps a hash of
+#define HISTORY_CHECK_BYTES 4096
+
+// Benchmark mode: bytes pushed through a plain pipe and through a $ fan-out per run
+#define BENCH_PIPE_BYTES (256L << 20)
+#define BENCH_FANOUT_BYTES (64L << 20)
+
 using namespace std;
 
-/* rightSideCommand()
-Executes the $ pipe operation on a single command on the right side given the input commands. For example, on an 
-input ls pwd $ wc, this function will first execute ls and pwd and writing the output to a shared pipe, then execute wc 
-by reading the contents of the pipe.
+extern char ** environ;
+
+/* A single stage of a pipeline: its argument vector and any file redirections */
+struct Command {
+    vector<string> argv;
+    string inFile;
+    string outFile;
+    bool append = false;
+};
+
+/* A parsed command line: stages joined by | and whether it ends in & */
+struct Pipeline {
+    vector<Command> stages;
+    bool background = false;
+};
+
+/* A parsed $ command line: N left-side commands whose combined output goes to each of M right-side commands */
+struct DollarCommand {
+    vector<Command> left;
+    vector<Command> right;
+};
+
+enum TokenType { TOKEN_WORD, TOKEN_PIPE, TOKEN_IN, TOKEN_OUT, TOKEN_APPEND, TOKEN_BACKGROUND, TOKEN_DOLLAR, TOKEN_COMMA };
+
+/* One token of a command line. text is only set for words, with quotes and escapes already removed. pattern is only set
+for words with an unquoted *, ? or [, and is the word as a glob() pattern, with its quoted characters escaped */
+struct Token {
+    TokenType type;
+    string text;
+    string pattern;
+};
+
+/* One distinct command in the history file: where its latest copy starts and how long it is, without the newline */
+struct HistoryEntry {
+    size_t offset;
+    size_t length;
+};
+
+/* Header at the start of a history index file, followed by count entries and the 2 * count max tree over them.
+covered is how much of the history file the index was built from, and check a hash of its last bytes */
+struct HistoryIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entryBytes;
+    uint64_t covered;
+    uint64_t count;
+    uint64_t check;
+};
+
+/* Ways of launching a program that the benchmark compares. SPAWN_SHELL is this shell's own path */
+enum SpawnStrategy { SPAWN_SYSTEM, SPAWN_FORK, SPAWN_VFORK, SPAWN_POSIX, SPAWN_SHELL, NUM_STRATEGIES };
+const char * strategyNames[NUM_STRATEGIES] = {"system", "fork+exec", "vfork+exec", "posix_spawn", "shell"};
+
+/* Resources used by one process, or summed over a command or the session */
+struct Usage {
+    string name;            // argv[0] of a process
+    double wall = 0;        // seconds from launch until reaped
+    double user = 0;
+    double sys = 0;
+    long maxRss = 0;        // KB, the largest of any process
+    long voluntary = 0;     // context switches
+    long involuntary = 0;
+    int status = 0;         // exit status
+
+    // Only set for the total of a $ command: bytes fanned out by the shell, and how often fanOut() had to wait for
+    // the left side to produce more or for a full right-side pipe to drain
+    long relayed = 0;
+    long sourceWaits = 0;
+    long targetWaits = 0;
+};
+
+/* A background job. Its stages share a process group, which lets the SIGCHLD handler reap them without touching
+foreground children. The handler only updates remaining and status; everything else is changed with SIGCHLD blocked */
+struct Job {
+    int id = 0;             // 0 when the slot is free
+    pid_t pgid;
+    pid_t lastPid;
+    int remaining;          // stages not reaped yet
+    int status;             // exit status of the last stage
+    string cmd;
+    bool timed;             // whether the command started with "time"
+    double start;
+    Usage usage;            // summed over the stages reaped so far, without touching usage.name
+};
+
+Job jobs[MAX_JOBS];
+
+// Set by the exit builtin
+bool exitRequested = false;
+
+// Whether the current command line started with "time", the -l JSON log, and the session totals for "times"
+bool timeCommand = false;
+FILE * usageLog = NULL;
+
+// Capacity in bytes given to every pipe the shell creates with -p, or 0 for the kernel's default
+int pipeCapacity = 0;
+
+// Command history: the file as it was at startup, mapped read-only, and the commands added since, which are also
+// appended to the file. The prefix index, sorted by text, and a max tree over its offsets cover the file's first
+// historyIndexed bytes. They are mapped from the index file beside it, or built by historyBuilder in the background
+// when that file is missing or too far behind; lookups wait for the builder with waitHistoryIndex()
+int historyFd = -1;
+const char * historyData = NULL;
+size_t historySize = 0;
+vector<string> sessionHistory;
+string historyIndexPath;
+const HistoryEntry * historyIndex = NULL;
+const size_t * historyLatest = NULL;
+size_t historyCount = 0;
+size_t historyIndexed = 0;
+vector<HistoryEntry> builtIndex;
+vector<size_t> builtLatest;
+pthread_t historyBuilder;
+bool historyBuilding = false;
+Usage session;
+int sessionCommands = 0;
+
+// Command name to path cache, like bash's hash table, the PATH it was built from, and whether any PATH entry is
+// relative to the current directory
+unordered_map<string, string> commandCache;
+string cachedPath;
+vector<string> pathDirs;
+bool pathRelative = false;
+
+/* tokenizeCommandLine()
+Splits a command line into words and the operators |, <, >, >>, & and $. Operators don't need spaces around them, so
+"ls|wc>out" gives {ls, |, wc, >, out}. Inside single quotes every character is literal; inside double quotes a
+backslash escapes ", \\ and $; outside quotes a backslash escapes any character. When commas is true, an unquoted
+"," is also an operator, which separates the commands on each side of a $. Words with an unquoted *, ? or [ are marked
+as patterns for addWord() to expand.
+The line is scanned through a string_view, and each word is copied out once: plain words as a single slice, and words
+with quotes or escapes built up as they are unescaped.
+Parameters:
+    -line is the command line to split
+    -commas says whether "," is an operator
+    -tokens receives the tokens
+Returns false if a quote is left open or the line ends in a lone backslash.
+*/
+
+bool tokenizeCommandLine(string_view line, bool commas, vector<Token> & tokens) {
+
+    tokens.clear();
+    size_t i = 0;
+
+    while (i < line.size()) {
+        char c = line[i];
+
+        if (isspace((unsigned char) c)) {
+            i++;
+            continue;
+        }
+
+        // Operators
+        TokenType op = TOKEN_WORD;
+        if (c == '|') op = TOKEN_PIPE;
+        else if (c == '<') op = TOKEN_IN;
+        else if (c == '>') op = (i + 1 < line.size() && line[i+1] == '>') ? TOKEN_APPEND : TOKEN_OUT;
+        else if (c == '&') op = TOKEN_BACKGROUND;
+        else if (c == '$') op = TOKEN_DOLLAR;
+        else if (c == ',' && commas) op = TOKEN_COMMA;
+
+        if (op != TOKEN_WORD) {
+            tokens.push_back({op, ""});
+            i += op == TOKEN_APPEND ? 2 : 1;
+            continue;
+        }
+
+        // Find where the word ends, noting whether it needs unescaping
+        size_t start = i;
+        bool plain = true;
+        char quote = 0;
+        for (; i < line.size(); i++) {
+            c = line[i];
+            if (quote != 0) {
+                if (c == quote) quote = 0;
+                else if (c == '\\' && quote == '"') i++;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+                plain = false;
+            } else if (c == '\\') {
+                plain = false;
+                i++;
+            } else if (isspace((unsigned char) c) || c == '|' || c == '<' || c == '>' || c == '&' || c == '$'
+                || (c == ',' && commas)) {
+                break;
+            }
+        }
+        if (quote != 0 || i > line.size()) {
+            return false;
+        }
+
+        string_view word = line.substr(start, i - start);
+        if (plain) {
+            bool isPattern = word.find_first_of("*?[") != string_view::npos;
+            tokens.push_back({TOKEN_WORD, string(word), isPattern ? string(word) : ""});
+            continue;
+        }
+
+        // The pattern is built alongside the text, escaping the quoted characters glob() would treat as special
+        string text;
+        string pattern;
+        bool isPattern = false;
+        text.reserve(word.size());
+        for (size_t j = 0; j < word.size(); j++) {
+            c = word[j];
+            size_t added = text.size();
+            bool literal = true;
+            if (quote == '\'') {
+                if (c == '\'') quote = 0;
+                else text += c;
+            } else if (quote == '"') {
+                if (c == '"') quote = 0;
+                else if (c == '\\' && (word[j+1] == '"' || word[j+1] == '\\' || word[j+1] == '$')) text += word[++j];
+                else text += c;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == '\\') {
+                text += word[++j];
+            } else {
+                text += c;
+                literal = false;
+                if (c == '*' || c == '?' || c == '[') isPattern = true;
+            }
+
+            for (; added < text.size(); added++) {
+                if (literal && strchr("*?[]\\", text[added]) != NULL) pattern += '\\';
+                pattern += text[added];
+            }
+        }
+        tokens.push_back({TOKEN_WORD, text, isPattern ? pattern : ""});
+    }
+
+    return true;
+}
+
+
+/* parseRedirection()
+Handles a <, > or >> token at tokens[i] by storing the file name that follows it in cmd.
+Returns false if there is no file name.
+*/
+
+bool parseRedirection(const vector<Token> & tokens, int & i, Command & cmd) {
+
+    if (i + 1 >= tokens.size() || tokens[i+1].type != TOKEN_WORD) {
+        return false;
+    }
+    if (tokens[i].type == TOKEN_IN) {
+        cmd.inFile = tokens[i+1].text;
+    } else {
+        cmd.outFile = tokens[i+1].text;
+        cmd.append = tokens[i].type == TOKEN_APPEND;
+    }
+    i++;
+    return true;
+}
+
+
+/* addWord()
+Appends a word to an argument vector. A pattern is replaced by the file names it matches, in sorted order as /bin/sh
+gives them; a pattern that matches nothing is kept as it is.
+*/
+
+void addWord(const Token & token, vector<string> & argv) {
+
+    if (token.pattern.empty()) {
+        argv.push_back(token.text);
+        return;
+    }
+
+    glob_t matches;
+    if (glob(token.pattern.c_str(), 0, NULL, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            argv.push_back(matches.gl_pathv[i]);
+        }
+    } else {
+        argv.push_back(token.text);
+    }
+    globfree(&matches);
+}
+
+
+/* parseCommandLine()
+Builds a Pipeline from the tokens of a command line. Returns false if the line is not a valid command, for example when
+a | has nothing on one side, a redirection has no file name or & is not at the end.
+Parameters:
+    -tokens are the tokens of the command line
+    -pipeline receives the parsed stages
+*/
+
+bool parseCommandLine(const vector<Token> & tokens, Pipeline & pipeline) {
+
+    pipeline.stages.assign(1, Command());
+
+    for (int i = 0; i < tokens.size(); i++) {
+        Command & stage = pipeline.stages.back();
+
+        switch (tokens[i].type) {
+            case TOKEN_PIPE:
+                if (stage.argv.empty()) return false;
+                pipeline.stages.push_back(Command());
+                break;
+            case TOKEN_IN:
+            case TOKEN_OUT:
+            case TOKEN_APPEND:
+                if (!parseRedirection(tokens, i, stage)) return false;
+                break;
+            case TOKEN_BACKGROUND:
+                if (i != tokens.size() - 1) return false;
+                pipeline.background = true;
+                break;
+            case TOKEN_WORD:
+                addWord(tokens[i], stage.argv);
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return !pipeline.stages.back().argv.empty();
+}
+
+
+/* parseDollarSide()
+Parses the commands on one side of a $, from tokens[begin] up to tokens[end]. If the line contains commas, they
+separate the commands and each command keeps its arguments ("ls -l, pwd $ wc -l"). Otherwise every word is a command
+of its own, as in "ls pwd $ wc". Redirections apply to the command before them.
+Returns false if a command is empty or a redirection has no file name.
+*/
+
+bool parseDollarSide(const vector<Token> & tokens, int begin, int end, bool hasComma, vector<Command> & cmds) {
+
+    cmds.assign(1, Command());
+
+    for (int i = begin; i < end; i++) {
+        switch (tokens[i].type) {
+            case TOKEN_WORD:
+                if (!hasComma && !cmds.back().argv.empty()) {
+                    cmds.push_back(Command());
+                }
+                addWord(tokens[i], cmds.back().argv);
+                break;
+            case TOKEN_COMMA:
+                if (cmds.back().argv.empty()) return false;
+                cmds.push_back(Command());
+                break;
+            case TOKEN_IN:
+            case TOKEN_OUT:
+            case TOKEN_APPEND:
+                if (cmds.back().argv.empty() || i + 1 >= end) return false;
+                if (!parseRedirection(tokens, i, cmds.back())) return false;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return !cmds.back().argv.empty();
+}
+
+
+/* parseDollarCommand()
+Builds the left and right command lists of a $ command line from its tokens. Exactly one $ is allowed.
+*/
+
+bool parseDollarCommand(const vector<Token> & tokens, DollarCommand & dollarCmd) {
+
+    int dollar = -1;
+    bool hasComma = false;
+    for (int i = 0; i < tokens.size(); i++) {
+        if (tokens[i].type == TOKEN_COMMA) hasComma = true;
+        if (tokens[i].type == TOKEN_DOLLAR) {
+            if (dollar != -1) return false;
+            dollar = i;
+        }
+    }
+
+    return dollar != -1 && parseDollarSide(tokens, 0, dollar, hasComma, dollarCmd.left)
+        && parseDollarSide(tokens, dollar + 1, tokens.size(), hasComma, dollarCmd.right);
+}
+
+
+/* loadPath()
+Splits PATH into pathDirs and empties the command cache. An empty PATH entry means the current directory, and an unset
+PATH falls back to /bin:/usr/bin as execvp() does.
+*/
+
+void loadPath(const char * path) {
+
+    cachedPath = path;
+    commandCache.clear();
+    pathDirs.clear();
+    pathRelative = false;
+
+    size_t start = 0;
+    while (true) {
+        size_t end = cachedPath.find(':', start);
+        string dir = cachedPath.substr(start, end == string::npos ? string::npos : end - start);
+        pathDirs.push_back(dir.empty() ? "." : dir);
+        if (pathDirs.back()[0] != '/') pathRelative = true;
+
+        if (end == string::npos) break;
+        start = end + 1;
+    }
+}
+
+
+/* resolveCommand()
+Finds the file a command name runs, so it can be exec'd directly instead of having posix_spawnp() try execve() in
+each PATH directory in turn. Names containing a / are used as they are. As in bash, a hit costs no system calls at
+all: it stays cached until PATH changes, "hash -r" is run, or spawning it fails because the file is gone (see
+forgetCommand()). Misses are not cached, so a newly installed command is found.
+Parameters:
+    -name is the command name, argv[0]
+    -path receives the file to exec
+Returns false if the command is not on PATH.
+*/
+
+bool resolveCommand(const string & name, string & path) {
+
+    if (name.find('/') != string::npos) {
+        path = name;
+        return true;
+    }
+
+    const char * pathVar = getenv("PATH");
+    if (pathVar == NULL) pathVar = "/bin:/usr/bin";
+    if (cachedPath != pathVar || pathDirs.empty()) {
+        loadPath(pathVar);
+    }
+
+    auto found = commandCache.find(name);
+    if (found != commandCache.end()) {
+        path = found->second;
+        return true;
+    }
+
+    // One stat() per directory, stopping at the first executable regular file
+    for (int i = 0; i < pathDirs.size(); i++) {
+        string candidate = pathDirs[i] + "/" + name;
+        struct stat info;
+        if (stat(candidate.c_str(), &info) == 0 && S_ISREG(info.st_mode) && (info.st_mode & 0111) != 0) {
+            commandCache[name] = candidate;
+            path = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* forgetCommand()
+Drops a command from the cache after its cached file could not be exec'd, so the next lookup searches PATH again.
+Returns true if it was cached.
+*/
+
+bool forgetCommand(const string & name) {
+
+    return commandCache.erase(name) > 0;
+}
+
+
+/* now()
+Returns the time in seconds from a monotonic clock.
+*/
+
+double now() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* exitCode()
+Turns a wait status into an exit code the way shells do: the program's exit status, or 128 plus the signal that
+killed it.
+*/
+
+int exitCode(int status) {
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+/* addRusage()
+Adds the resources in ru to usage. Safe to call from a signal handler.
+*/
+
+void addRusage(Usage & usage, const struct rusage & ru) {
+
+    usage.user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    usage.sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    if (ru.ru_maxrss > usage.maxRss) usage.maxRss = ru.ru_maxrss;
+    usage.voluntary += ru.ru_nvcsw;
+    usage.involuntary += ru.ru_nivcsw;
+}
+
+
+/* waitStages()
+Waits for every process of a foreground command and records what each one used. Processes are reaped in whatever
+order they finish, with wait4() on the shell's own process group, so each one's wall time ends when it exits rather
+than when the ones before it do. Background jobs run in groups of their own and are left alone.
+Parameters:
+    -pids are the processes to wait for; negative entries, for processes that never started, are skipped
+    -stages has an entry for each pid, with its name already set, which receives its usage
+    -start is when the processes were launched
+*/
+
+void waitStages(const vector<pid_t> & pids, vector<Usage> & stages, double start) {
+
+    int remaining = 0;
+    for (int i = 0; i < pids.size(); i++) {
+        if (pids[i] > 0) remaining++;
+    }
+
+    while (remaining > 0) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(0, &status, 0, &ru);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < pids.size(); i++) {
+            if (pids[i] != pid) continue;
+            stages[i].wall = now() - start;
+            stages[i].status = exitCode(status);
+            addRusage(stages[i], ru);
+            remaining--;
+        }
+    }
+}
+
+
+/* sumUsage()
+Adds up the usage of a command's processes. Times and context switches are summed, max RSS is the largest of any
+process, and the exit status is the last process's.
+*/
+
+Usage sumUsage(const vector<Usage> & stages, double wall) {
+
+    Usage total;
+    total.wall = wall;
+    for (int i = 0; i < stages.size(); i++) {
+        total.user += stages[i].user;
+        total.sys += stages[i].sys;
+        if (stages[i].maxRss > total.maxRss) total.maxRss = stages[i].maxRss;
+        total.voluntary += stages[i].voluntary;
+        total.involuntary += stages[i].involuntary;
+        total.status = stages[i].status;
+    }
+    return total;
+}
+
+
+/* printUsage()
+Prints one row of a "time" report to stderr.
+*/
+
+void printUsage(const char * name, const Usage & usage) {
+
+    fprintf(stderr, "%-12s %9.3fs real %9.3fs user %9.3fs sys %9ld KB max RSS %7ld/%ld switches  exit %d\n",
+        name, usage.wall, usage.user, usage.sys, usage.maxRss, usage.voluntary, usage.involuntary, usage.status);
+}
+
+
+/* printRelay()
+Prints how much data a $ command's fan-out moved, and how often it waited on each side, to stderr.
+*/
+
+void printRelay(const Usage & usage) {
+
+    fprintf(stderr, "%-12s %9.1f MB relayed, waited %ld times for input and %ld times on full pipes\n", "fan-out",
+        usage.relayed / 1048576.0, usage.sourceWaits, usage.targetWaits);
+}
+
+
+/* writeJsonString()
+Writes s to file as a quoted JSON string.
+*/
+
+void writeJsonString(FILE * file, const string & s) {
+
+    fputc('"', file);
+    for (int i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+
+/* writeJsonUsage()
+Writes the fields of a Usage to file as the members of a JSON object.
+*/
+
+void writeJsonUsage(FILE * file, const Usage & usage) {
+
+    fprintf(file, "\"wall_seconds\": %.6f, \"user_seconds\": %.6f, \"sys_seconds\": %.6f, \"max_rss_kb\": %ld, "
+        "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld, \"exit\": %d", usage.wall, usage.user, usage.sys,
+        usage.maxRss, usage.voluntary, usage.involuntary, usage.status);
+}
+
+
+/* recordCommand()
+Accounts for a finished command: adds it to the session totals, appends it to the JSON log if there is one, and
+prints a time report of every process and the total if it was asked for.
+Parameters:
+    -cmd is the command line
+    -stages is the usage of each process; empty for background jobs, which are only summed
+    -total is the usage of the whole command
+    -print says whether to print the report
+*/
+
+void recordCommand(const string & cmd, const vector<Usage> & stages, const Usage & total, bool print) {
+
+    sessionCommands++;
+    session.wall += total.wall;
+    session.user += total.user;
+    session.sys += total.sys;
+    if (total.maxRss > session.maxRss) session.maxRss = total.maxRss;
+    session.voluntary += total.voluntary;
+    session.involuntary += total.involuntary;
+    session.status = total.status;
+    session.relayed += total.relayed;
+    session.sourceWaits += total.sourceWaits;
+    session.targetWaits += total.targetWaits;
+
+    if (usageLog != NULL) {
+        fprintf(usageLog, "{\"command\": ");
+        writeJsonString(usageLog, cmd);
+        fprintf(usageLog, ", ");
+        writeJsonUsage(usageLog, total);
+        if (total.relayed > 0) {
+            fprintf(usageLog, ", \"relayed_bytes\": %ld, \"source_waits\": %ld, \"target_waits\": %ld", total.relayed,
+                total.sourceWaits, total.targetWaits);
+        }
+        fprintf(usageLog, ", \"stages\": [");
+        for (int i = 0; i < stages.size(); i++) {
+            fprintf(usageLog, "%s{\"name\": ", i > 0 ? ", " : "");
+            writeJsonString(usageLog, stages[i].name);
+            fprintf(usageLog, ", ");
+            writeJsonUsage(usageLog, stages[i]);
+            fprintf(usageLog, "}");
+        }
+        fprintf(usageLog, "]}\n");
+        fflush(usageLog);
+    }
+
+    if (print) {
+        for (int i = 0; i < stages.size(); i++) {
+            printUsage(stages[i].name.c_str(), stages[i]);
+        }
+        printUsage("total", total);
+        if (total.relayed > 0) {
+            printRelay(total);
+        }
+    }
+}
+
+
+/* stripTimePrefix()
+Removes a leading "time" keyword from a command line, which asks for a report of the resources the rest of the line
+uses. Returns whether it was there.
+*/
+
+bool stripTimePrefix(string & cmd) {
+
+    size_t start = cmd.find_first_not_of(" \t");
+    if (start == string::npos || cmd.compare(start, 4, "time") != 0) {
+        return false;
+    }
+    if (start + 4 < cmd.size() && !isspace((unsigned char) cmd[start + 4])) {
+        return false;
+    }
+    size_t rest = cmd.find_first_not_of(" \t", start + 4);
+    cmd.erase(0, rest == string::npos ? cmd.size() : rest);
+    return true;
+}
+
+
+/* sigchldHandler()
+Reaps every finished stage of every background job, through each job's process group so foreground children are
+left to their own wait4(). Each stage's resources are added to its job. Only async-signal-safe calls are made here.
+*/
+
+void sigchldHandler(int sig) {
+
+    int savedErrno = errno;
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job & job = jobs[i];
+        while (job.id != 0 && job.remaining > 0) {
+            int status;
+            struct rusage ru;
+            pid_t pid = wait4(-job.pgid, &status, WNOHANG, &ru);
+            if (pid == 0) break;
+            if (pid == -1) {
+                // Nothing left in the group to wait for
+                job.remaining = 0;
+                break;
+            }
+            addRusage(job.usage, ru);
+            job.remaining--;
+            if (pid == job.lastPid) {
+                job.status = exitCode(status);
+            }
+        }
+    }
+
+    errno = savedErrno;
+}
+
+
+/* blockSigchld()
+Blocks SIGCHLD so the job table can be read and changed safely, saving the previous mask in oldMask.
+*/
+
+void blockSigchld(sigset_t * oldMask) {
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, oldMask);
+}
+
+
+/* finishJob()
+Accounts for a background job whose stages have all been reaped and frees its slot. Called with SIGCHLD blocked.
+*/
+
+void finishJob(Job & job) {
+
+    job.usage.wall = now() - job.start;
+    job.usage.status = job.status;
+    recordCommand(job.cmd, vector<Usage>(), job.usage, job.timed);
+    job.id = 0;
+}
+
+
+/* reportJobs()
+Prints and frees every background job that has finished. Called with SIGCHLD blocked.
+*/
+
+void reportJobs() {
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0 || jobs[i].remaining > 0) continue;
+
+        if (jobs[i].status == 0) {
+            printf("[%d]  Done\t\t%s\n", jobs[i].id, jobs[i].cmd.c_str());
+        } else {
+            printf("[%d]  Exit %d\t\t%s\n", jobs[i].id, jobs[i].status, jobs[i].cmd.c_str());
+        }
+        fflush(stdout);
+        finishJob(jobs[i]);
+    }
+}
+
+
+/* findFreeJob()
+Returns a free slot in the job table, first waiting for a background job to finish if all MAX_JOBS are running.
+Called with SIGCHLD blocked; waitMask is the mask to wait under, which must not block SIGCHLD.
+*/
+
+Job & findFreeJob(const sigset_t * waitMask) {
+
+    while (true) {
+        reportJobs();
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id == 0) return jobs[i];
+        }
+        sigsuspend(waitMask);
+    }
+}
+
+
+/* findJob()
+Looks up a job by the argument of a job builtin, either "%n" or "n". With no argument, the most recent job is
+returned. Returns NULL if there is no such job.
+*/
+
+Job * findJob(const vector<string> & argv) {
+
+    Job * found = NULL;
+
+    if (argv.size() < 2) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0 && (found == NULL || jobs[i].id > found->id)) found = &jobs[i];
+        }
+        return found;
+    }
+
+    const char * arg = argv[1].c_str();
+    if (*arg == '%') arg++;
+    int id = atoi(arg);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (id > 0 && jobs[i].id == id) found = &jobs[i];
+    }
+    return found;
+}
+
+
+/* waitForJob()
+Waits for every stage of a background job to be reaped, then frees the job. Called with SIGCHLD blocked.
+Returns the exit status of the job's last stage.
+*/
+
+int waitForJob(Job & job, const sigset_t * waitMask) {
+
+    while (job.remaining > 0) {
+        sigsuspend(waitMask);
+    }
+    finishJob(job);
+    return job.status;
+}
+
+
+/* addHistory()
+Appends a command to the history file with a single write(), so concurrent shells never interleave within a line,
+and remembers it for this session.
+*/
+
+void addHistory(const string & cmd) {
+
+    if (historyFd == -1) {
+        return;
+    }
+    sessionHistory.push_back(cmd);
+    string line = cmd + "\n";
+    if (write(historyFd, line.data(), line.size()) == -1) {
+        printf("Error writing the history file: %s\n", strerror(errno));
+    }
+}
+
+
+/* compareHistory()
+Orders index entries by their text, then by where they are in the file.
+*/
+
+bool compareHistory(const HistoryEntry & a, const HistoryEntry & b) {
+
+    int order = memcmp(historyData + a.offset, historyData + b.offset, min(a.length, b.length));
+    if (order != 0) return order < 0;
+    if (a.length != b.length) return a.length < b.length;
+    return a.offset < b.offset;
+}
+
+
+/* historyCheck()
+FNV-1a hash of the last HISTORY_CHECK_BYTES of the history file before end. An index file keeps the hash of the part
+it covers, so an index left behind by a history file that has since been rewritten is not used.
+*/
+
+uint64_t historyCheck(size_t end) {
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = end > HISTORY_CHECK_BYTES ? end - HISTORY_CHECK_BYTES : 0; i < end; i++) {
+        hash = (hash ^ (unsigned char) historyData[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/* saveHistoryIndex()
+Writes the index just built to the index file for later sessions. It goes to a temporary file that is renamed over
+the old one, so another shell never maps a half-written index. Failures are ignored: the next session builds it again.
+Parameters:
+    -covered is how much of the history file the index was built from
+*/
+
+void saveHistoryIndex(size_t covered) {
+
+    string temporary = historyIndexPath + "." + to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return;
+    }
+
+    HistoryIndexHeader header;
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, 8);
+    header.version = HISTORY_INDEX_VERSION;
+    header.entryBytes = sizeof(HistoryEntry);
+    header.covered = covered;
+    header.count = builtIndex.size();
+    header.check = historyCheck(covered);
+
+    size_t indexBytes = builtIndex.size() * sizeof(HistoryEntry);
+    size_t latestBytes = builtLatest.size() * sizeof(size_t);
+    bool written = write(fd, &header, sizeof(header)) == sizeof(header)
+        && write(fd, builtIndex.data(), indexBytes) == (ssize_t) indexBytes
+        && write(fd, builtLatest.data(), latestBytes) == (ssize_t) latestBytes;
+    close(fd);
+
+    if (!written || rename(temporary.c_str(), historyIndexPath.c_str()) == -1) {
+        unlink(temporary.c_str());
+    }
+}
+
+
+/* buildHistoryIndex()
+Runs on historyBuilder. Builds the prefix index over the mapped history file, up to its last complete line: one entry
+per distinct command, at its latest position, sorted by text so every command with a given prefix sits in one
+contiguous range. The max tree over the entries' offsets finds the most recent command in any range in O(log n).
+Only publishes the result once it is done, and lookups join the thread before reading it.
+*/
+
+void * buildHistoryIndex(void * arg) {
+
+    size_t covered = historySize;
+    while (covered > 0 && historyData[covered - 1] != '\n') covered--;
+
+    for (size_t start = 0; start < covered; ) {
+        const char * end = (const char *) memchr(historyData + start, '\n', covered - start);
+        size_t length = end - (historyData + start);
+        if (length > 0) {
+            builtIndex.push_back({start, length});
+        }
+        start += length + 1;
+    }
+    sort(builtIndex.begin(), builtIndex.end(), compareHistory);
+
+    // Keep only the latest copy of each command, which sorts last among its duplicates
+    size_t kept = 0;
+    for (size_t i = 0; i < builtIndex.size(); i++) {
+        HistoryEntry & entry = builtIndex[i];
+        if (i + 1 < builtIndex.size() && builtIndex[i + 1].length == entry.length
+            && memcmp(historyData + entry.offset, historyData + builtIndex[i + 1].offset, entry.length) == 0) {
+            continue;
+        }
+        builtIndex[kept++] = entry;
+    }
+    builtIndex.resize(kept);
+
+    // Leaves at [n, 2n), each parent the larger of its two children
+    size_t n = builtIndex.size();
+    if (n > 0) {
+        builtLatest.assign(2 * n, 0);
+        for (size_t i = 0; i < n; i++) {
+            builtLatest[n + i] = builtIndex[i].offset;
+        }
+        for (size_t i = n - 1; i > 0; i--) {
+            builtLatest[i] = max(builtLatest[2 * i], builtLatest[2 * i + 1]);
+        }
+    }
+
+    saveHistoryIndex(covered);
+
+    historyIndex = builtIndex.data();
+    historyLatest = builtLatest.data();
+    historyCount = n;
+    historyIndexed = covered;
+    return NULL;
+}
+
+
+/* loadHistoryIndex()
+Maps the index file beside the history, if it is one: the right header, version and entry size, and a length that
+fits its entry count. It must also have been built from a part of the history that is still there unchanged, and the
+history must not have grown more than HISTORY_INDEX_SLACK past it since.
+Returns false if there is no such file, so a new one has to be built.
+*/
+
+bool loadHistoryIndex() {
+
+    int fd = open(historyIndexPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    HistoryIndexHeader header;
+    struct stat info;
+    size_t entryBytes = sizeof(HistoryEntry) + 2 * sizeof(size_t);
+    bool usable = fstat(fd, &info) == 0 && read(fd, &header, sizeof(header)) == sizeof(header)
+        && memcmp(header.magic, HISTORY_INDEX_MAGIC, 8) == 0 && header.version == HISTORY_INDEX_VERSION
+        && header.entryBytes == sizeof(HistoryEntry) && header.count <= (uint64_t) info.st_size / entryBytes
+        && (uint64_t) info.st_size == sizeof(header) + header.count * entryBytes
+        && header.covered <= historySize && historySize - header.covered <= HISTORY_INDEX_SLACK
+        && (header.covered == 0 || historyData[header.covered - 1] == '\n')
+        && header.check == historyCheck(header.covered);
+
+    void * data = NULL;
+    if (usable && header.count > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        usable = data != MAP_FAILED;
+    }
+    close(fd);
+    if (!usable) {
+        return false;
+    }
+
+    if (header.count > 0) {
+        historyIndex = (const HistoryEntry *) ((const char *) data + sizeof(header));
+        historyLatest = (const size_t *) (historyIndex + header.count);
+    }
+    historyCount = header.count;
+    historyIndexed = header.covered;
+    return true;
+}
+
+
+/* startHistoryBuilder()
+Starts building the index on historyBuilder. The thread blocks every signal, so SIGCHLD is still handled on the main
+thread, where the job table is protected. If no thread can be started, the index is built right away instead.
+*/
+
+void startHistoryBuilder() {
+
+    sigset_t all, oldMask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &oldMask);
+    historyBuilding = pthread_create(&historyBuilder, NULL, buildHistoryIndex, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    if (!historyBuilding) {
+        buildHistoryIndex(NULL);
+    }
+}
+
+
+/* waitHistoryIndex()
+Waits for historyBuilder if it is still building the index. Every lookup calls this first, so only one made right
+after startup, before the build is done, ever waits.
+*/
+
+void waitHistoryIndex() {
+
+    if (historyBuilding) {
+        pthread_join(historyBuilder, NULL);
+        historyBuilding = false;
+    }
+}
+
+
+/* openHistory()
+Opens the history file for appending, maps what it already holds, and maps the prefix index saved beside it. Nothing
+is read yet, so a history of millions of commands costs no more at startup than an empty one. Without a usable index
+file, one is built in the background while the shell takes commands.
+Returns false if the file could not be opened.
+*/
+
+bool openHistory(const char * path) {
+
+    historyFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (historyFd == -1) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(historyFd, &info) == 0 && info.st_size > 0) {
+        void * data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, historyFd, 0);
+        if (data != MAP_FAILED) {
+            historyData = (const char *) data;
+            historySize = info.st_size;
+        }
+    }
+
+    historyIndexPath = string(path) + ".idx";
+    if (historyData != NULL && !loadHistoryIndex()) {
+        startHistoryBuilder();
+    }
+    return true;
+}
+
+
+/* findHistoryRange()
+Finds the range of index entries that start with prefix, by binary search on the sorted index.
+Parameters:
+    -prefix is the text to look for
+    -first and last receive the range, [first, last)
+*/
+
+void findHistoryRange(const string & prefix, size_t & first, size_t & last) {
+
+    waitHistoryIndex();
+
+    // Compare only the first prefix.size() bytes, so the whole matching range compares equal to the prefix
+    auto below = [&](const HistoryEntry & entry, const string & key) {
+        size_t length = min(entry.length, key.size());
+        int order = memcmp(historyData + entry.offset, key.data(), length);
+        return order < 0 || (order == 0 && length < key.size());
+    };
+    auto above = [&](const string & key, const HistoryEntry & entry) {
+        size_t length = min(entry.length, key.size());
+        return memcmp(key.data(), historyData + entry.offset, length) < 0;
+    };
+    first = lower_bound(historyIndex, historyIndex + historyCount, prefix, below) - historyIndex;
+    last = upper_bound(historyIndex, historyIndex + historyCount, prefix, above) - historyIndex;
+}
+
+
+/* searchHistory()
+Finds the most recent command that starts with prefix, looking first at this session's commands, which are newer
+than anything in the file, then at the lines appended since the index was built, newest first, and then at the
+index.
+Parameters:
+    -prefix is the text the command starts with; an empty prefix finds the last command
+    -match receives the command
+Returns false if no command matches.
+*/
+
+bool searchHistory(const string & prefix, string & match) {
+
+    for (size_t i = sessionHistory.size(); i > 0; i--) {
+        if (sessionHistory[i - 1].compare(0, prefix.size(), prefix) == 0) {
+            match = sessionHistory[i - 1];
+            return true;
+        }
+    }
+    if (historyData == NULL) {
+        return false;
+    }
+
+    size_t first, last;
+    findHistoryRange(prefix, first, last);
+
+    // Lines appended since the index was built are newer than anything in it
+    size_t lineEnd = historySize;
+    if (lineEnd > historyIndexed && historyData[lineEnd - 1] == '\n') lineEnd--;
+    while (lineEnd > historyIndexed) {
+        size_t lineStart = lineEnd;
+        while (lineStart > historyIndexed && historyData[lineStart - 1] != '\n') lineStart--;
+        size_t length = lineEnd - lineStart;
+        if (length > 0 && string_view(historyData + lineStart, length).compare(0, prefix.size(), prefix) == 0) {
+            match.assign(historyData + lineStart, length);
+            return true;
+        }
+        if (lineStart == historyIndexed) break;
+        lineEnd = lineStart - 1;
+    }
+
+    if (first >= last) {
+        return false;
+    }
+
+    // Largest offset in [first, last), walking up the max tree
+    size_t n = historyCount;
+    size_t latest = 0;
+    for (size_t lo = first + n, hi = last + n; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) latest = max(latest, historyLatest[lo++]);
+        if (hi & 1) latest = max(latest, historyLatest[--hi]);
+    }
+
+    const char * end = (const char *) memchr(historyData + latest, '\n', historySize - latest);
+    match.assign(historyData + latest, (end == NULL ? historyData + historySize : end) - (historyData + latest));
+    return true;
+}
+
+
+/* expandHistory()
+Replaces a command line of the form !! or !prefix with the most recent command it refers to, and prints the result
+the way other shells do.
+Returns false if there is no such command.
+*/
+
+bool expandHistory(string & cmd) {
+
+    if (cmd.size() < 2 || cmd[0] != '!') {
+        return true;
+    }
+
+    string match;
+    if (!searchHistory(cmd == "!!" ? "" : cmd.substr(1), match)) {
+        printf("%s: event not found\n", cmd.c_str());
+        return false;
+    }
+    cmd = match;
+    printf("%s\n", cmd.c_str());
+    fflush(stdout);
+    return true;
+}
+
+
+/* builtinCd()
+Changes the shell's directory to argv[1], or to $HOME without an argument, and updates PWD and OLDPWD.
+*/
+
+int builtinCd(const vector<string> & argv) {
+
+    const char * dir = argv.size() > 1 ? argv[1].c_str() : getenv("HOME");
+    if (dir == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    char cwd[4096];
+    const char * old = getenv("PWD");
+    if (old != NULL) setenv("OLDPWD", old, 1);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) setenv("PWD", cwd, 1);
+
+    // Relative PATH entries now name other directories
+    if (pathRelative) pathDirs.clear();
+    return 0;
+}
+
+
+/* builtinPwd()
+Prints the shell's current directory.
+*/
+
+int builtinPwd(const vector<string> & argv) {
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+
+/* builtinEcho()
+Prints its arguments separated by spaces, followed by a newline unless the first argument is -n.
+*/
+
+int builtinEcho(const vector<string> & argv) {
+
+    int first = 1;
+    bool newline = true;
+    if (argv.size() > 1 && argv[1] == "-n") {
+        first = 2;
+        newline = false;
+    }
+
+    for (int i = first; i < argv.size(); i++) {
+        fputs(argv[i].c_str(), stdout);
+        if (i < argv.size() - 1) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+
+/* builtinExit()
+Asks the shell to exit, with status argv[1] or 0. main() and runBatch() stop once the current command is done.
+*/
+
+int builtinExit(const vector<string> & argv) {
+
+    exitRequested = true;
+    return argv.size() > 1 ? atoi(argv[1].c_str()) & 0xff : 0;
+}
+
+
+/* builtinJobs()
+Lists the background jobs and whether each is still running.
+*/
+
+int builtinJobs(const vector<string> & argv) {
+
+    sigset_t oldMask;
+    blockSigchld(&oldMask);
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].remaining > 0) {
+            printf("[%d]  Running\t\t%s\n", jobs[i].id, jobs[i].cmd.c_str());
+        }
+    }
+    reportJobs();
+
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    return 0;
+}
+
+
+/* builtinWait()
+Waits for job argv[1], or for every background job without an argument.
+Returns the exit status of the job waited for, or 0 after waiting for all of them.
+*/
+
+int builtinWait(const vector<string> & argv) {
+
+    sigset_t oldMask;
+    blockSigchld(&oldMask);
+    sigset_t waitMask = oldMask;
+    sigdelset(&waitMask, SIGCHLD);
+
+    int status = 0;
+    if (argv.size() < 2) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].id != 0) waitForJob(jobs[i], &waitMask);
+        }
+    } else {
+        Job * job = findJob(argv);
+        if (job == NULL) {
+            fprintf(stderr, "wait: no such job\n");
+            status = 127;
+        } else {
+            status = waitForJob(*job, &waitMask);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    return status;
+}
+
+
+/* builtinFg()
+Brings job argv[1], or the most recent job, to the foreground and waits for it.
+Returns the job's exit status.
+*/
+
+int builtinFg(const vector<string> & argv) {
+
+    sigset_t oldMask;
+    blockSigchld(&oldMask);
+    sigset_t waitMask = oldMask;
+    sigdelset(&waitMask, SIGCHLD);
+
+    int status = 1;
+    Job * job = findJob(argv);
+    if (job == NULL) {
+        fprintf(stderr, "fg: no such job\n");
+    } else {
+        printf("%s\n", job->cmd.c_str());
+        fflush(stdout);
+
+        // Hand the terminal to the job, and continue it in case it stopped trying to read it in the background
+        bool terminal = isatty(STDIN_FILENO);
+        if (terminal) tcsetpgrp(STDIN_FILENO, job->pgid);
+        kill(-job->pgid, SIGCONT);
+        status = waitForJob(*job, &waitMask);
+        if (terminal) tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    return status;
+}
+
+
+/* builtinHash()
+"hash" lists the cached command paths and "hash -r" empties the cache.
+*/
+
+int builtinHash(const vector<string> & argv) {
+
+    if (argv.size() > 1 && argv[1] == "-r") {
+        commandCache.clear();
+        pathDirs.clear();
+        return 0;
+    }
+    for (auto & entry : commandCache) {
+        printf("%s\t%s\n", entry.first.c_str(), entry.second.c_str());
+    }
+    return 0;
+}
+
+
+/* builtinTimes()
+Prints the resources used by every command of the session so far, summed.
+*/
+
+int builtinTimes(const vector<string> & argv) {
+
+    char name[32];
+    snprintf(name, sizeof(name), "%d commands", sessionCommands);
+    printUsage(name, session);
+    if (session.relayed > 0) {
+        printRelay(session);
+    }
+    return 0;
+}
+
+
+/* builtinHistory()
+"history [n]" lists the last n commands, 16 by default, walking back from the end of the file so nothing else is
+read. "history -p prefix" lists every distinct command that starts with prefix, sorted, from the prefix index, the
+lines appended to the file since it was built, and this session's commands.
+*/
+
+int builtinHistory(const vector<string> & argv) {
+
+    if (historyFd == -1) {
+        fprintf(stderr, "history: no history file\n");
+        return 1;
+    }
+
+    if (argv.size() > 2 && argv[1] == "-p") {
+        const string & prefix = argv[2];
+        size_t first = 0, last = 0;
+        vector<string> session;
+        if (historyData != NULL) {
+            findHistoryRange(prefix, first, last);
+            for (size_t start = historyIndexed; start < historySize; ) {
+                const char * end = (const char *) memchr(historyData + start, '\n', historySize - start);
+                size_t length = (end == NULL ? historyData + historySize : end) - (historyData + start);
+                if (length > 0 && string_view(historyData + start, length).compare(0, prefix.size(), prefix) == 0) {
+                    session.push_back(string(historyData + start, length));
+                }
+                start += length + 1;
+            }
+        }
+        for (int i = 0; i < sessionHistory.size(); i++) {
+            if (sessionHistory[i].compare(0, prefix.size(), prefix) == 0) session.push_back(sessionHistory[i]);
+        }
+        sort(session.begin(), session.end());
+        session.erase(unique(session.begin(), session.end()), session.end());
+
+        // Both lists are sorted and distinct, so merge them, printing a command that is in both once
+        size_t next = 0;
+        while (first < last || next < session.size()) {
+            string_view entry;
+            if (first < last) entry = string_view(historyData + historyIndex[first].offset, historyIndex[first].length);
+            if (first < last && (next == session.size() || entry < string_view(session[next]))) {
+                printf("%.*s\n", (int) entry.size(), entry.data());
+                first++;
+            } else {
+                if (first < last && entry == string_view(session[next])) first++;
+                printf("%s\n", session[next].c_str());
+                next++;
+            }
+        }
+        return 0;
+    }
+
+    int count = argv.size() > 1 && atoi(argv[1].c_str()) > 0 ? atoi(argv[1].c_str()) : HISTORY_LIST;
+    int fromSession = min(count, (int) sessionHistory.size());
+
+    // The newest lines of the file, found backwards
+    vector<string> older;
+    size_t end = historySize;
+    if (end > 0 && historyData[end - 1] == '\n') end--;
+    while (older.size() < count - fromSession && end > 0) {
+        size_t start = end;
+        while (start > 0 && historyData[start - 1] != '\n') start--;
+        older.push_back(string(historyData + start, end - start));
+        end = start > 0 ? start - 1 : 0;
+    }
+
+    for (size_t i = older.size(); i > 0; i--) {
+        printf("%s\n", older[i - 1].c_str());
+    }
+    for (int i = sessionHistory.size() - fromSession; i < sessionHistory.size(); i++) {
+        printf("%s\n", sessionHistory[i].c_str());
+    }
+    return 0;
+}
+
+
+/* A command the shell runs itself instead of exec'ing a program */
+struct Builtin {
+    const char * name;
+    int (*run)(const vector<string> & argv);
+};
+
+Builtin builtins[] = {
+    {"cd", builtinCd},
+    {"pwd", builtinPwd},
+    {"echo", builtinEcho},
+    {"exit", builtinExit},
+    {"jobs", builtinJobs},
+    {"wait", builtinWait},
+    {"fg", builtinFg},
+    {"hash", builtinHash},
+    {"times", builtinTimes},
+    {"history", builtinHistory},
+};
+
+
+/* findBuiltin()
+Returns the builtin named by a command's argv[0], or NULL if the command runs a program.
+*/
+
+Builtin * findBuiltin(const Command & cmd) {
+
+    for (int i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (cmd.argv[0] == builtins[i].name) return &builtins[i];
+    }
+    return NULL;
+}
+
+
+/* applyRedirections()
+Points stdin and stdout at a command's files or the given pipe ends, the way spawnStage()'s file actions do for
+programs. Used before running a builtin.
+Parameters:
+    -cmd is the command whose redirections to apply
+    -inFd and outFd are pipe ends for stdin and stdout, or -1 to keep the current ones
+Returns false if a file could not be opened.
+*/
+
+bool applyRedirections(const Command & cmd, int inFd, int outFd) {
+
+    if (!cmd.inFile.empty()) {
+        inFd = open(cmd.inFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (inFd == -1) {
+            fprintf(stderr, "%s: %s\n", cmd.inFile.c_str(), strerror(errno));
+            return false;
+        }
+        dup2(inFd, STDIN_FILENO);
+        close(inFd);
+    } else if (inFd != -1) {
+        dup2(inFd, STDIN_FILENO);
+    }
+
+    if (!cmd.outFile.empty()) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd.append ? O_APPEND : O_TRUNC);
+        outFd = open(cmd.outFile.c_str(), flags, 0644);
+        if (outFd == -1) {
+            fprintf(stderr, "%s: %s\n", cmd.outFile.c_str(), strerror(errno));
+            return false;
+        }
+        dup2(outFd, STDOUT_FILENO);
+        close(outFd);
+    } else if (outFd != -1) {
+        dup2(outFd, STDOUT_FILENO);
+    }
+    return true;
+}
+
+
+/* runBuiltinInShell()
+Runs a builtin in the shell process itself, so it costs no process at all and cd changes the shell's own directory.
+Any redirections apply only while it runs.
+Parameters:
+    -builtin is the builtin to run
+    -cmd is its command
+    -usage receives what the shell used while running it, as getrusage() sees it
+Returns the builtin's exit status.
+*/
+
+int runBuiltinInShell(const Builtin & builtin, const Command & cmd, Usage & usage) {
+
+    double start = now();
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+
+    fflush(stdout);
+    int savedIn = dup(STDIN_FILENO);
+    int savedOut = dup(STDOUT_FILENO);
+
+    int status = 1;
+    if (applyRedirections(cmd, -1, -1)) {
+        status = builtin.run(cmd.argv);
+    }
+
+    fflush(stdout);
+    dup2(savedIn, STDIN_FILENO);
+    dup2(savedOut, STDOUT_FILENO);
+    close(savedIn);
+    close(savedOut);
+
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    usage.name = cmd.argv[0];
+    usage.wall = now() - start;
+    usage.user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+    usage.sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+    usage.maxRss = after.ru_maxrss;
+    usage.voluntary = after.ru_nvcsw - before.ru_nvcsw;
+    usage.involuntary = after.ru_nivcsw - before.ru_nivcsw;
+    usage.status = status;
+    return status;
+}
+
+
+/* spawnBuiltin()
+Runs a builtin that is part of a pipeline or a $ command in a forked child, which has to exist so the builtin can run
+alongside the other stages. The child sets up its stdin and stdout like spawnStage() does and exits with the
+builtin's status. Parameters are as for spawnStage().
+*/
+
+pid_t spawnBuiltin(const Builtin & builtin, const Command & cmd, int inFd, int outFd, const vector<int> & pipeFds,
+    pid_t pgid) {
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("Error running %s: %s\n", builtin.name, strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (pgid != -1) setpgid(0, pgid);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // The shell's background jobs are not this child's to wait for
+        for (int i = 0; i < MAX_JOBS; i++) {
+            jobs[i].id = 0;
+        }
+
+        int status = 1;
+        if (applyRedirections(cmd, inFd, outFd)) {
+            for (int i = 0; i < pipeFds.size(); i++) {
+                close(pipeFds[i]);
+            }
+            status = builtin.run(cmd.argv);
+        }
+        fflush(stdout);
+        _exit(status);
+    }
+
+    // Also set here so the group exists before the next stage joins it
+    if (pgid != -1) setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+
+/* spawnStage()
+Launches one pipeline stage with posix_spawn(), which uses vfork-style process creation and execs the command's path,
+found through the command cache, directly. The stage reads from inFd and writes to outFd unless it has its own file redirections, which take priority.
+Builtins are run by spawnBuiltin() instead.
+Parameters:
+    -cmd is the stage to launch
+    -inFd and outFd are pipe ends for stdin and stdout, or -1 to inherit the shell's
+    -pipeFds lists every open pipe end, all of which are closed in the child
+    -pgid is the process group to put the child in: -1 for the shell's, 0 for a new one led by the child, or the
+     leader of an existing one
+Returns the child's pid, -1 if the command could not be run, or REDIRECT_FAILED if one of its files could not be
+opened.
+*/
+
+pid_t spawnStage(const Command & cmd, int inFd, int outFd, const vector<int> & pipeFds, pid_t pgid) {
+
+    Builtin * builtin = findBuiltin(cmd);
+    if (builtin != NULL) {
+        return spawnBuiltin(*builtin, cmd, inFd, outFd, pipeFds, pgid);
+    }
+
+    // The files are opened here rather than by a spawn file action, so a missing file is reported as such and not as
+    // a command that could not be run
+    int inFile = -1;
+    int outFile = -1;
+    if (!cmd.inFile.empty()) {
+        inFile = open(cmd.inFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (inFile == -1) {
+            fprintf(stderr, "%s: %s\n", cmd.inFile.c_str(), strerror(errno));
+            return REDIRECT_FAILED;
+        }
+    }
+    if (!cmd.outFile.empty()) {
+        outFile = open(cmd.outFile.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (cmd.append ? O_APPEND : O_TRUNC), 0644);
+        if (outFile == -1) {
+            fprintf(stderr, "%s: %s\n", cmd.outFile.c_str(), strerror(errno));
+            if (inFile != -1) close(inFile);
+            return REDIRECT_FAILED;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    if (inFile != -1) {
+        posix_spawn_file_actions_adddup2(&actions, inFile, STDIN_FILENO);
+    } else if (inFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    }
+
+    if (outFile != -1) {
+        posix_spawn_file_actions_adddup2(&actions, outFile, STDOUT_FILENO);
+    } else if (outFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    }
+
+    // Unneeded once stdin and stdout are set up
+    for (int i = 0; i < pipeFds.size(); i++) {
+        posix_spawn_file_actions_addclose(&actions, pipeFds[i]);
+    }
+
+    vector<char*> args;
+    for (int i = 0; i < cmd.argv.size(); i++) {
+        args.push_back((char*) cmd.argv[i].c_str());
+    }
+    args.push_back(NULL);
+
+    // The child must not inherit a blocked SIGCHLD or the shell's ignored SIGTTOU
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    string path;
+    int error = ENOENT;
+    if (resolveCommand(cmd.argv[0], path)) {
+        error = posix_spawn(&pid, path.c_str(), &actions, &attr, args.data(), environ);
+
+        // The cached file was removed since it was found, so search PATH again. ENOENT also comes from a script
+        // whose interpreter is missing, which another search would not help
+        if (error == ENOENT && access(path.c_str(), F_OK) == -1 && forgetCommand(cmd.argv[0])
+            && resolveCommand(cmd.argv[0], path)) {
+            error = posix_spawn(&pid, path.c_str(), &actions, &attr, args.data(), environ);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (inFile != -1) close(inFile);
+    if (outFile != -1) close(outFile);
+
+    if (error != 0) {
+        printf("Error running %s: %s\n", args[0], strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+
+/* failedStageStatus()
+Returns the exit status of a stage that never started, as sh reports it: 1 when a redirection failed and 127 when the
+command could not be run.
+*/
+
+int failedStageStatus(pid_t pid) {
+
+    return pid == REDIRECT_FAILED ? 1 : 127;
+}
+
+
+/* setupPipeCapacity()
+Checks a -p pipe capacity against the largest the system allows, /proc/sys/fs/pipe-max-size, and lowers it to that
+if needed. Returns the capacity that will be used.
+*/
+
+int setupPipeCapacity(int requested) {
+
+    int maximum = 0;
+    FILE * file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%d", &maximum) != 1) maximum = 0;
+        fclose(file);
+    }
+    if (maximum > 0 && requested > maximum) {
+        printf("Pipe capacity lowered to the system maximum of %d bytes\n", maximum);
+        return maximum;
+    }
+    return requested;
+}
+
+
+/* makePipe()
+Creates a close-on-exec pipe, resized to pipeCapacity if -p asked for one. A bigger pipe lets a fast writer get
+further ahead of a slow reader before it blocks.
+Returns -1 if the pipe could not be created.
+*/
+
+int makePipe(int fds[2]) {
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipeCapacity > 0) {
+        // Can fail past the user's pipe buffer limits, which leaves the default size
+        fcntl(fds[WRITE], F_SETPIPE_SZ, pipeCapacity);
+    }
+    return 0;
+}
+
+
+/* launchPipeline()
+Creates a pipe between each pair of neighbouring stages and spawns every stage once. The stages of a background
+pipeline are put in a process group of their own, led by the first stage.
+Parameter:
+    -pipeline is the parsed command line to run
+Returns the pid of each stage in order, with spawnStage()'s -1 or REDIRECT_FAILED for a stage that could not be started.
+*/
+
+vector<pid_t> launchPipeline(const Pipeline & pipeline) {
+
+    int numStages = pipeline.stages.size();
+    vector<int> pipeFds;
+
+    for (int i = 0; i < numStages - 1; i++) {
+        int fds[2];
+        if (makePipe(fds) == -1) {
+            printf("Error creating a pipe\n");
+            for (int j = 0; j < pipeFds.size(); j++) {
+                close(pipeFds[j]);
+            }
+            return vector<pid_t>();
+        }
+        pipeFds.push_back(fds[READ]);
+        pipeFds.push_back(fds[WRITE]);
+    }
+
+    vector<pid_t> pids;
+    for (int i = 0; i < numStages; i++) {
+        // Stage i reads from pipe i-1 and writes to pipe i
+        int inFd = i > 0 ? pipeFds[2*(i-1) + READ] : -1;
+        int outFd = i < numStages - 1 ? pipeFds[2*i + WRITE] : -1;
+
+        // The first stage that starts leads the group
+        pid_t pgid = -1;
+        if (pipeline.background) {
+            pgid = 0;
+            for (int j = 0; j < pids.size(); j++) {
+                if (pids[j] > 0) {
+                    pgid = pids[j];
+                    break;
+                }
+            }
+        }
+
+        pids.push_back(spawnStage(pipeline.stages[i], inFd, outFd, pipeFds, pgid));
+    }
+
+    // The shell keeps no pipe ends, so readers see EOF once their writers exit
+    for (int i = 0; i < pipeFds.size(); i++) {
+        close(pipeFds[i]);
+    }
+    return pids;
+}
+
+
+/* rightSideCommand()
+Starts a single right-side command of a $ pipe, such as "wc -l", reading from its own pipe.
+Parameters:
+    -outCmd is the right-side command to execute
+    -writeFd receives the write end of the command's input pipe, which the shell fans the left-side output into
+Returns the child's pid, or -1 if it could not be started.
+*/
+
+pid_t rightSideCommand(const Command & outCmd, int * writeFd) {
+
+    int fds[2];
+    if (makePipe(fds) == -1) {
+        printf("Error creating a pipe for a right-side command\n");
+        return -1;
+    }
+
+    pid_t pid = spawnStage(outCmd, fds[READ], -1, vector<int>(), -1);
+
+    // Unneeded in the shell
+    close(fds[READ]);
+
+    if (pid < 0) {
+        close(fds[WRITE]);
+        return -1;
+    }
+    *writeFd = fds[WRITE];
+    return pid;
+}
+
+
+/* waitRelay()
+Waits until a fan-out step that would have blocked can go on, counting whether it was waiting for the left side to
+produce data, for a right-side pipe to drain, or both.
+Parameters:
+    -sourceFd is the left-side pipe, or -1 if the step only writes
+    -targetFd is a right-side pipe, or -1 if the step only reads
+    -stats receives the counts in sourceWaits and targetWaits
+*/
+
+void waitRelay(int sourceFd, int targetFd, Usage & stats) {
+
+    struct pollfd fds[2] = {{sourceFd, POLLIN, 0}, {targetFd, POLLOUT, 0}};
+    poll(fds, 2, 0);
+
+    // Only wait on the side that is not ready yet
+    if (sourceFd != -1 && fds[0].revents == 0) {
+        stats.sourceWaits++;
+    } else {
+        fds[0].fd = -1;
+    }
+    if (targetFd != -1 && fds[1].revents == 0) {
+        stats.targetWaits++;
+    } else {
+        fds[1].fd = -1;
+    }
+    // A signal such as SIGCHLD cutting the wait short is not another wait
+    if (fds[0].fd != -1 || fds[1].fd != -1) {
+        while (poll(fds, 2, -1) == -1 && errno == EINTR) {}
+    }
+}
+
+
+/* relayTee(), relaySplice(), relayRead(), relayWrite()
+tee(), splice(), read() and write() on the fan-out's non-blocking pipes, waiting with waitRelay() whenever one would
+block, so they behave like the blocking calls but count every wait in stats. A call interrupted by a signal is just
+made again, without counting a wait.
+*/
+
+ssize_t relayTee(int sourceFd, int targetFd, size_t length, Usage & stats) {
+
+    while (true) {
+        ssize_t n = tee(sourceFd, targetFd, length, SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINTR) continue;
+        if (n != -1 || errno != EAGAIN) return n;
+        waitRelay(sourceFd, targetFd, stats);
+    }
+}
+
+ssize_t relaySplice(int sourceFd, int targetFd, size_t length, Usage & stats) {
+
+    while (true) {
+        ssize_t n = splice(sourceFd, NULL, targetFd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINTR) continue;
+        if (n != -1 || errno != EAGAIN) return n;
+        waitRelay(sourceFd, targetFd, stats);
+    }
+}
+
+ssize_t relayRead(int sourceFd, char * buffer, size_t length, Usage & stats) {
+
+    while (true) {
+        ssize_t n = read(sourceFd, buffer, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n != -1 || errno != EAGAIN) return n;
+        waitRelay(sourceFd, -1, stats);
+    }
+}
+
+ssize_t relayWrite(int targetFd, const char * buffer, size_t length, Usage & stats) {
+
+    while (true) {
+        ssize_t n = write(targetFd, buffer, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n != -1 || errno != EAGAIN) return n;
+        waitRelay(-1, targetFd, stats);
+    }
+}
+
+
+/* fanOut()
+Copies everything that arrives on sourceFd to every fd in targets without passing it through user space. Each
+round, tee() duplicates the pending bytes into all targets but the last, and splice() then moves them into the last
+one, which consumes them from the source. If a tee() into a full pipe copies only part of a round, the round falls
+back to reading the bytes once and writing the missing part, so every target still gets the same stream. Targets
+whose reader has exited are dropped.
+The shell's ends of the pipes are made non-blocking so every time the relay would have blocked is counted. A round
+moves up to a pipe's capacity, so bigger pipes from -p mean fewer, larger rounds.
 Parameters:
-    -inCmds is a vector of the input (left-side) commands. In the above example, it would contain {"ls", "pwd"}
-    -outCmd is a string representing the right-side command to execute, such as "wc"
+    -sourceFd is the read end of the left-side pipe
+    -targets are the write ends of the right-side commands' pipes
+    -stats receives the bytes relayed and the number of waits on each side
 */
 
+void fanOut(int sourceFd, vector<int> targets, Usage & stats) {
 
-int rightSideCommand(vector<string> inCmds, string outCmd) {
+    int numTargets = targets.size();
+    vector<bool> alive(numTargets, true);
+    vector<ssize_t> copied(numTargets);
 
-    // Create a pipe
-    int fds[2];
-    int p = pipe(fds);
-    if (p == -1) {
-        printf("Error creating a pipe for a right-side command\n");
-        exit(0);
+    // Only the shell has these ends open, so the children's ends stay blocking
+    fcntl(sourceFd, F_SETFL, fcntl(sourceFd, F_GETFL) | O_NONBLOCK);
+    for (int i = 0; i < numTargets; i++) {
+        fcntl(targets[i], F_SETFL, fcntl(targets[i], F_GETFL) | O_NONBLOCK);
     }
 
-    // Execute left-side commands
+    int chunk = max(FANOUT_CHUNK, fcntl(sourceFd, F_GETPIPE_SZ));
+    vector<char> storage(chunk);
+    char * buffer = storage.data();
+
+    while (true) {
+        // Find a live target to measure the round with; if none are left, drain the source
+        int first = 0;
+        while (first < numTargets && !alive[first]) {
+            first++;
+        }
+        if (first == numTargets) {
+            while (relayRead(sourceFd, buffer, chunk, stats) > 0) {}
+            return;
+        }
+
+        int last = numTargets - 1;
+        while (!alive[last]) {
+            last--;
+        }
+
+        ssize_t n;
+        if (first == last) {
+            // Single consumer: move the data straight across
+            n = relaySplice(sourceFd, targets[last], chunk, stats);
+            if (n == -1 && errno == EPIPE) {
+                alive[last] = false;
+                continue;
+            }
+            if (n <= 0) return;
+            stats.relayed += n;
+            continue;
+        }
+
+        // Duplicate into the first live target; this also tells us how much the round holds
+        n = relayTee(sourceFd, targets[first], chunk, stats);
+        if (n == -1 && errno == EPIPE) {
+            alive[first] = false;
+            continue;
+        }
+        if (n <= 0) return;
+        stats.relayed += n;
+
+        bool partial = false;
+        for (int i = first; i < last; i++) {
+            copied[i] = i == first ? n : 0;
+            if (i == first || !alive[i]) continue;
+
+            copied[i] = relayTee(sourceFd, targets[i], n, stats);
+            if (copied[i] == -1) {
+                if (errno == EPIPE) alive[i] = false;
+                copied[i] = n;
+            } else if (copied[i] < n) {
+                partial = true;
+            }
+        }
 
-    int leftChild = fork();
+        if (!partial) {
+            // Move the round into the last target, consuming it from the source
+            ssize_t moved = 0;
+            while (moved < n) {
+                ssize_t m = relaySplice(sourceFd, targets[last], n - moved, stats);
+                if (m <= 0) {
+                    if (m == -1 && errno == EPIPE) alive[last] = false;
+                    break;
+                }
+                moved += m;
+            }
+            // A dead last target still has to have its share consumed
+            while (moved < n) {
+                ssize_t m = relayRead(sourceFd, buffer, n - moved, stats);
+                if (m <= 0) return;
+                moved += m;
+            }
+            continue;
+        }
 
-    if (leftChild == -1) {
-        printf("Error forking for left-side commands\n");
-        exit(0);
+        // Rare slow path: read the round once and top up the targets that got less
+        ssize_t got = 0;
+        while (got < n) {
+            ssize_t m = relayRead(sourceFd, buffer + got, n - got, stats);
+            if (m <= 0) return;
+            got += m;
+        }
+        copied[last] = 0;
+        for (int i = first; i <= last; i++) {
+            if (!alive[i]) continue;
+            for (ssize_t off = copied[i]; off < n; ) {
+                ssize_t m = relayWrite(targets[i], buffer + off, n - off, stats);
+                if (m <= 0) {
+                    alive[i] = false;
+                    break;
+                }
+                off += m;
+            }
+        }
     }
-    // Child code
-    else if (leftChild == 0) {
+}
 
-        // Set output to pipe
-        dup2(fds[WRITE], fileno(stdout));
 
-        // Unneeded
-        close(fds[READ]);
-        close(fds[WRITE]);
+/* broadcast()
+Writes length bytes to every live target, dropping the targets whose reader has exited.
+*/
+
+void broadcast(const char * data, size_t length, const vector<int> & targets, vector<bool> & alive, Usage & stats) {
+
+    for (int i = 0; i < targets.size(); i++) {
+        for (size_t off = 0; alive[i] && off < length; ) {
+            ssize_t m = relayWrite(targets[i], data + off, length - off, stats);
+            if (m <= 0) {
+                alive[i] = false;
+                break;
+            }
+            off += m;
+        }
+    }
+}
+
+
+/* mergeOut()
+Used instead of fanOut() when there are several left-side commands. Each one writes into a pipe of its own, and this
+reads them as their data arrives and copies only whole lines to every target, so the lines of different commands never
+mix, however much a command writes at once. A command's last line is passed on when it exits even without a newline,
+and a line longer than a pipe's capacity is passed on in pieces. The data has to pass through user space here, since
+the line ends are looked for in it.
+Parameters:
+    -sources are the read ends of the left-side commands' pipes
+    -targets are the write ends of the right-side commands' pipes
+    -stats receives the bytes relayed and the number of waits on each side
+*/
+
+void mergeOut(const vector<int> & sources, const vector<int> & targets, Usage & stats) {
 
-        // Execute each left-side command
-        for (int i = 0; i < inCmds.size(); i++) {
-            //leftSideCommand(inCmds.at(i), fds);
+    int numSources = sources.size();
+    vector<bool> alive(targets.size(), true);
+    vector<struct pollfd> fds(numSources);
 
-            int leftCmd = fork();
+    // Only the shell has these ends open, so the children's ends stay blocking
+    for (int i = 0; i < numSources; i++) {
+        fcntl(sources[i], F_SETFL, fcntl(sources[i], F_GETFL) | O_NONBLOCK);
+        fds[i] = {sources[i], POLLIN, 0};
+    }
+    for (int i = 0; i < targets.size(); i++) {
+        fcntl(targets[i], F_SETFL, fcntl(targets[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    // Each source's bytes not yet passed on: the start of a line that hasn't ended yet
+    size_t chunk = max(FANOUT_CHUNK, fcntl(sources[0], F_GETPIPE_SZ));
+    vector<vector<char>> pending(numSources, vector<char>(chunk));
+    vector<size_t> used(numSources, 0);
+
+    int open = numSources;
+    while (open > 0) {
+        // Wait for any left-side command to have data, counting it when none has any yet
+        if (poll(fds.data(), numSources, 0) == 0) {
+            stats.sourceWaits++;
+            while (poll(fds.data(), numSources, -1) == -1 && errno == EINTR) {}
+        }
 
-            if (leftCmd == -1) {
-                exit(0);
-            } else if (leftCmd == 0) {
+        for (int i = 0; i < numSources; i++) {
+            if (fds[i].fd == -1 || fds[i].revents == 0) continue;
 
-                char* command[] = {inCmds.at(i).data(), NULL};
-                execvp(inCmds.at(i).c_str(), command);
-                printf("Error in execvp for a left-side command\n");
-                exit(0);
+            char * data = pending[i].data();
+            ssize_t n = read(fds[i].fd, data + used[i], chunk - used[i]);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
 
+            // Pass on everything up to the last newline, or all of it once the source ends or the buffer is full
+            size_t cut = 0;
+            if (n <= 0) {
+                fds[i].fd = -1;
+                open--;
+                cut = used[i];
             } else {
-                int status;
-                waitpid(leftCmd, &status, 0);
+                const char * newline = (const char *) memrchr(data + used[i], '\n', n);
+                used[i] += n;
+                cut = newline != NULL ? newline - data + 1 : used[i] == chunk ? chunk : 0;
+            }
+
+            if (cut > 0) {
+                broadcast(data, cut, targets, alive, stats);
+                stats.relayed += cut;
+                memmove(data, data + cut, used[i] - cut);
+                used[i] -= cut;
             }
         }
-        exit(0);
     }
-    // Parent code
-    else {
-        int status;
+}
 
-        waitpid(leftChild, &status, 0);
-    }
 
-    
+/* executeDollarCommand()
+Executes the $ pipe operation. For an input ls pwd $ wc sort, ls and pwd are started once, at the same time, each
+writing into a pipe of its own, and wc and sort are each started once on their own pipe. The shell then relays the
+left-side output to every right-side command, with fanOut() for a single left-side command and mergeOut(), which keeps
+lines whole, for several, and waits for all of them.
+Parameter:
+    -cmd is the command line, for resource accounting
+    -dollarCmd holds the input (left-side) commands, {ls, pwd} in the above example, and the output (right-side)
+     commands, {wc, sort}
+Returns the exit status of the last right-side command.
+*/
+
+int executeDollarCommand(const string & cmd, const DollarCommand & dollarCmd) {
 
-    // Execute right-side command
+    double start = now();
+    vector<pid_t> pids;
+    vector<Usage> stages;
+    Usage relay;
 
-    dup2(fds[READ], fileno(stdin));
+    // Start the right-side commands first so they are ready to read
+    vector<int> targets;
+    for (int i = 0; i < dollarCmd.right.size(); i++) {
+        int writeFd;
+        pid_t pid = rightSideCommand(dollarCmd.right[i], &writeFd);
+        if (pid > 0) {
+            pids.push_back(pid);
+            stages.push_back(Usage());
+            stages.back().name = dollarCmd.right[i].argv[0];
+            targets.push_back(writeFd);
+        }
+    }
 
-    // Unneeded
-    close(fds[READ]);
-    close(fds[WRITE]);
+    // Start every left-side command on a pipe of its own
+    vector<int> sources;
+    for (int i = 0; i < dollarCmd.left.size(); i++) {
+        int fds[2];
+        if (makePipe(fds) == -1) {
+            printf("Error creating a pipe for a left-side command\n");
+            break;
+        }
+        pid_t pid = spawnStage(dollarCmd.left[i], -1, fds[WRITE], vector<int>(), -1);
+
+        // Unneeded, so the source reports EOF once its command exits
+        close(fds[WRITE]);
 
-    int child = fork();
+        if (pid > 0) {
+            pids.push_back(pid);
+            stages.push_back(Usage());
+            stages.back().name = dollarCmd.left[i].argv[0];
+            sources.push_back(fds[READ]);
+        } else {
+            close(fds[READ]);
+        }
+    }
 
-    if (child == -1) {
-        printf("Error forking for a right-side command\n");
-        exit(0);
+    // A right-side command that exits early must not kill the shell with SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    if (sources.size() == 1) {
+        fanOut(sources[0], targets, relay);
+    } else if (sources.size() > 1) {
+        mergeOut(sources, targets, relay);
     }
-    // Child code
-    else if (child == 0) {
+    signal(SIGPIPE, SIG_DFL);
 
-        char* rightCommand[] = {outCmd.data(), NULL};
-        execvp(outCmd.c_str(), rightCommand);
-        printf("Error in execvp for a right-side command\n");
-        exit(0);
+    for (int i = 0; i < sources.size(); i++) {
+        close(sources[i]);
     }
-    // Parent code
-    else {
-        int status;
-        waitpid(child, &status, 0);
+    for (int i = 0; i < targets.size(); i++) {
+        close(targets[i]);
     }
 
-    return 0;
+    waitStages(pids, stages, start);
+    Usage total = sumUsage(stages, now() - start);
+    total.status = targets.empty() ? 0 : stages[targets.size() - 1].status;
+    total.relayed = relay.relayed;
+    total.sourceWaits = relay.sourceWaits;
+    total.targetWaits = relay.targetWaits;
+    recordCommand(cmd, stages, total, timeCommand);
+    return total.status;
 }
 
 
 /* executeNormalCommand()
-Executes all non-$-pipe commands using system(), and checks the string for the background "&" feature, waiting for
-the child to finish executing if it is not there.
+Executes all non-$-pipe commands by parsing them into a pipeline and spawning each stage directly, and waits for
+every stage to finish unless the command ends in "&". A "&" command is added to the job table instead, to be reaped by
+sigchldHandler(), and waits for a free slot first if MAX_JOBS jobs are already running. A lone builtin runs in the
+shell itself without creating a process.
 Parameter:
     -cmd is a string representing the command to execute
+Returns the exit status of the last stage, or 0 for background commands.
 */
 
 int executeNormalCommand(string cmd) {
 
-    int background = cmd.find("&");
+    vector<Token> tokens;
+    Pipeline pipeline;
+    if (!tokenizeCommandLine(cmd, false, tokens) || !parseCommandLine(tokens, pipeline)) {
+        printf("Invalid command. Please try again\n");
+        return -1;
+    }
 
-    pid_t child = fork();
-    // Child code
-    if (child == 0) {
-        
-        if (background != string::npos) {
-            // Remove "&", since it's handled manually
-            cmd = cmd.substr(0,strlen(cmd.c_str())-2);
+    if (pipeline.stages.size() == 1 && !pipeline.background) {
+        Builtin * builtin = findBuiltin(pipeline.stages[0]);
+        if (builtin != NULL) {
+            vector<Usage> stages(1);
+            int status = runBuiltinInShell(*builtin, pipeline.stages[0], stages[0]);
+            recordCommand(cmd, stages, sumUsage(stages, stages[0].wall), timeCommand);
+            return status;
         }
+    }
 
-        system(cmd.c_str());
-        exit(0);
+    // Launch with SIGCHLD blocked so no stage can be reaped before its job is in the table
+    if (pipeline.background) {
+        sigset_t oldMask;
+        blockSigchld(&oldMask);
+        sigset_t waitMask = oldMask;
+        sigdelset(&waitMask, SIGCHLD);
 
-    } else if (child < 0) {
-        printf("Error forking a child\n");
-        exit(0);
-    }
-    // Parent code
-    else {
-        // Wait for child if no "&"
-        if (background == string::npos) {
-            int status;
-            waitpid(child, &status, 0);
-        } else {
-            return 0;
+        Job & job = findFreeJob(&waitMask);
+        double start = now();
+        vector<pid_t> pids = launchPipeline(pipeline);
+        vector<pid_t> started;
+        for (int i = 0; i < pids.size(); i++) {
+            if (pids[i] > 0) started.push_back(pids[i]);
+        }
+        if (!started.empty()) {
+            int id = 1;
+            for (int i = 0; i < MAX_JOBS; i++) {
+                if (jobs[i].id >= id) id = jobs[i].id + 1;
+            }
+            job.id = id;
+            job.pgid = started[0];
+            job.lastPid = pids.back();
+            job.remaining = started.size();
+            job.status = pids.back() < 0 ? failedStageStatus(pids.back()) : 0;
+            job.cmd = cmd;
+            job.timed = timeCommand;
+            job.start = start;
+            job.usage = Usage();
+            printf("[%d] %d\n", job.id, job.pgid);
         }
+
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+        return 0;
     }
-    return 0;
+
+    double start = now();
+    vector<pid_t> pids = launchPipeline(pipeline);
+
+    vector<Usage> stages(pids.size());
+    for (int i = 0; i < pids.size(); i++) {
+        stages[i].name = pipeline.stages[i].argv[0];
+        if (pids[i] < 0) stages[i].status = failedStageStatus(pids[i]);
+    }
+    waitStages(pids, stages, start);
+
+    Usage total = sumUsage(stages, now() - start);
+    recordCommand(cmd, stages, total, timeCommand);
+    return total.status;
 }
 
 
-/* main()
-Infinite while loop prompting the user for commands and parsing the command for $. Passes commands to other functions above for 
-execution, and performs some input validation.
+/* startBatchLine()
+Starts one line of a batch script without waiting for it. A normal line is launched as a pipeline; a $ line needs the
+shell to fan its output out, so it runs in a forked copy of the shell. A lone builtin runs in the shell right away.
+"&" changes nothing, since every line already runs alongside the others.
+Parameters:
+    -cmd is the line to run
+    -pids receives the pid of each process to wait for, or a negative value for one that could not start
+    -stages receives an entry for each pid, named after it; for a builtin, it holds the finished builtin's usage
+Returns false if the line is not a valid command.
 */
 
-int main()
-{
+bool startBatchLine(const string & cmd, vector<pid_t> & pids, vector<Usage> & stages) {
 
-    cout << "\nType \"exit\" to quit the program\n\n" << endl;
+    vector<Token> tokens;
+    if (!tokenizeCommandLine(cmd, false, tokens)) {
+        return false;
+    }
 
-    while(true) {
-        string prompt = "/User/ % ";
-        cout << prompt;
-        string cmd;
-        getline(cin, cmd);
+    bool dollar = false;
+    for (int i = 0; i < tokens.size(); i++) {
+        if (tokens[i].type == TOKEN_DOLLAR) dollar = true;
+    }
 
-        // Check for exit command
-        if (strcmp(cmd.c_str(), "exit") == 0) {
-            return 0;
+    if (!dollar) {
+        Pipeline pipeline;
+        if (!parseCommandLine(tokens, pipeline)) {
+            return false;
+        }
+        pipeline.background = false;
+        if (pipeline.stages.size() == 1) {
+            Builtin * builtin = findBuiltin(pipeline.stages[0]);
+            if (builtin != NULL) {
+                stages.resize(1);
+                runBuiltinInShell(*builtin, pipeline.stages[0], stages[0]);
+                return true;
+            }
         }
 
-        int dollar = cmd.find("$");
-
-        // No special piping, handles everything other than $ commands
-        if (dollar == string::npos) {
-            // Some input validation for invalid commands
-            int ch1 = cmd.find("<");
-            int ch2 = cmd.find(">");
-            int ch3 = cmd.find("|");
-            if (ch1 == 0 || ch1 == strlen(cmd.c_str())-1 || ch2 == 0 || ch2 == strlen(cmd.c_str())-1 || ch3 == 0 || ch3 == strlen(cmd.c_str())-1) {
-                printf("Invalid command. Please try again\n");
-            } else {
-                ch1 = cmd.rfind("<");
-                ch2 = cmd.rfind(">");
-                ch3 = cmd.rfind("|");
-                if (ch1 == 0 || ch1 == strlen(cmd.c_str())-1 || ch2 == 0 || ch2 == strlen(cmd.c_str())-1 || ch3 == 0 || ch3 == strlen(cmd.c_str())-1) {
-                    printf("Invalid command. Please try again\n");
-                } else {
-                    executeNormalCommand(cmd);
-                }
-            }       
+        pids = launchPipeline(pipeline);
+        stages.resize(pids.size());
+        for (int i = 0; i < pids.size(); i++) {
+            stages[i].name = pipeline.stages[i].argv[0];
+            if (pids[i] < 0) stages[i].status = failedStageStatus(pids[i]);
         }
+        return true;
+    }
+
+    DollarCommand dollarCmd;
+    if (!tokenizeCommandLine(cmd, true, tokens) || !parseDollarCommand(tokens, dollarCmd)) {
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The batch accounts for the forked shell as a whole, children included
+        usageLog = NULL;
+        timeCommand = false;
+        _exit(executeDollarCommand(cmd, dollarCmd));
+    }
+    pids.assign(1, pid);
+    stages.resize(1);
+    stages[0].name = "$";
+    if (pid == -1) stages[0].status = 127;
+    return true;
+}
 
-        // Special piping, used for $ inputs
-        else {
 
-            // Parse the string
-            string left = cmd.substr(0, dollar);
-            int end = strlen(cmd.c_str())-dollar;
-            string right = cmd.substr(dollar+1, end);
+/* runBatch()
+Runs the lines of a script, keeping up to parallelism of them running at once like xargs -P. Lines are read as slots
+free up, so a long stream of commands starts running right away. Blank lines and lines starting with # are skipped,
+a line that is just "wait" waits for every earlier line before going on, and the exit builtin stops the script once
+the running lines finish. Each line is accounted for like an interactive command, and may start with "time". Once
+every line has finished, the exit code of each is printed to stderr in script order.
+Parameters:
+    -in is the script
+    -parallelism is the most lines that may run at once
+Returns 0 if every line exited with 0, and 1 otherwise.
+*/
+
+int runBatch(istream & in, int parallelism) {
+
+    vector<string> lines;
+    vector<int> statuses;
+    vector<bool> timed;
+    vector<double> starts;
+    vector<vector<Usage>> usages;       // usage of each process of each line
+    vector<int> remaining;              // processes each line is still waiting for
+    unordered_map<pid_t, int> owner;    // line each running process belongs to
+    unordered_map<pid_t, int> stage;    // index of each running process within its line
+    int running = 0;
+    bool barrier = false;
+    bool more = true;
 
-            // parse left side input
-            int space = left.rfind(" ");
-            while (space == strlen(left.c_str())-1) {
-                // Trim whitespace from end of left side
-                left = left.substr(0, strlen(left.c_str())-1);
-                space = left.rfind(" ");
+    while (more || running > 0) {
+        // Start lines until every slot is busy, the script ends or a "wait" line has to let the others finish
+        while (more && !barrier && running < parallelism) {
+            string cmd;
+            if (!getline(in, cmd)) {
+                more = false;
+                break;
             }
 
-            space = left.find(" ");
-            while (space == 0) {
-                // Trim whitespace from beginning of left side
-                left = left.substr(1, strlen(left.c_str())-1);
-                space = left.find(" ");
+            size_t start = cmd.find_first_not_of(" \t");
+            if (start == string::npos || cmd[start] == '#') continue;
+            if (cmd.compare(start, string::npos, "wait") == 0) {
+                barrier = true;
+                break;
             }
 
-            // parse right-side command(s)
-            space = right.rfind(" ");
-            while (space == strlen(right.c_str())-1) {
-                // Trim whitespace from end of right side
-                right = right.substr(0, strlen(right.c_str())-1);
-                space = right.rfind(" ");
+            int line = lines.size();
+            lines.push_back(cmd);
+            statuses.push_back(0);
+            timed.push_back(stripTimePrefix(cmd));
+            starts.push_back(now());
+            usages.push_back(vector<Usage>());
+            remaining.push_back(0);
+
+            vector<pid_t> pids;
+            if (!startBatchLine(cmd, pids, usages[line])) {
+                printf("Invalid command: %s\n", cmd.c_str());
+                statuses[line] = 2;
+                continue;
             }
 
-            space = right.find(" ");
-            while (space == 0) {
-                // Trim whitespace from beginning of right side
-                right = right.substr(1, strlen(right.c_str())-1);
-                space = right.find(" ");
+            for (int i = 0; i < pids.size(); i++) {
+                if (pids[i] < 0) continue;
+                owner[pids[i]] = line;
+                stage[pids[i]] = i;
+                remaining[line]++;
+            }
+            if (remaining[line] > 0) {
+                running++;
+            } else {
+                Usage total = sumUsage(usages[line], now() - starts[line]);
+                statuses[line] = total.status;
+                recordCommand(lines[line], usages[line], total, timed[line]);
             }
+            if (exitRequested) more = false;
+        }
 
+        if (running == 0) {
+            barrier = false;
+            continue;
+        }
 
-            vector<string> inCmds;
-            space = left.find(" ");
-            if (space != string::npos) {
-                // Two left-side commands
-                inCmds.push_back(left.substr(0, space));
-                inCmds.push_back(left.substr(space+1, strlen(left.c_str())-space));
-            } else {
-                // Only one left-side command
-                inCmds.push_back(left);
+        // Reap whichever process finishes next
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        auto found = owner.find(pid);
+        if (found == owner.end()) continue;
+
+        int line = found->second;
+        Usage & usage = usages[line][stage[pid]];
+        usage.wall = now() - starts[line];
+        usage.status = exitCode(status);
+        addRusage(usage, ru);
+        owner.erase(found);
+        stage.erase(pid);
+
+        if (--remaining[line] == 0) {
+            running--;
+            Usage total = sumUsage(usages[line], now() - starts[line]);
+            statuses[line] = total.status;
+            recordCommand(lines[line], usages[line], total, timed[line]);
+        }
+    }
+
+    int result = 0;
+    for (int i = 0; i < lines.size(); i++) {
+        fprintf(stderr, "[%d] exit %d\t%s\n", i + 1, statuses[i], lines[i].c_str());
+        if (statuses[i] != 0) result = 1;
+    }
+    return result;
+}
+
+
+/* executeLine()
+Runs one interactive command line, either as a normal command or as a $ command.
+Returns the command's exit status, or -1 if it is not a valid command.
+*/
+
+int executeLine(const string & cmd) {
+
+    vector<Token> tokens;
+    if (!tokenizeCommandLine(cmd, false, tokens)) {
+        printf("Invalid command. Please try again\n");
+        return -1;
+    }
+
+    bool dollar = false;
+    for (int i = 0; i < tokens.size(); i++) {
+        if (tokens[i].type == TOKEN_DOLLAR) dollar = true;
+    }
+
+    // No special piping, handles everything other than $ commands
+    if (!dollar) {
+        return tokens.empty() ? 0 : executeNormalCommand(cmd);
+    }
+
+    // Special piping, used for $ inputs. Commas separate the commands on each side of a $, so tokenize again with
+    // them as operators
+    DollarCommand dollarCmd;
+    if (!tokenizeCommandLine(cmd, true, tokens) || !parseDollarCommand(tokens, dollarCmd)) {
+        printf("Invalid command. Please try again\n");
+        return -1;
+    }
+
+    // Pass left and right side commands to execution function
+    return executeDollarCommand(cmd, dollarCmd);
+}
+
+
+/* launchDirect()
+Starts one benchmark stage with one of the low-level strategies. fork+exec copies the shell's page tables, vfork+exec
+borrows them until the child execs, and posix_spawn is the path spawnStage() uses. Every pipe end the benchmark makes
+is close-on-exec, so the child keeps only the two it is given.
+Parameters:
+    -strategy is SPAWN_FORK, SPAWN_VFORK or SPAWN_POSIX
+    -cmd is the stage to launch; of its redirections only an output file is supported
+    -inFd and outFd are pipe ends for stdin and stdout, or -1 to inherit the shell's
+Returns the child's pid, or -1 if it could not be started.
+*/
+
+pid_t launchDirect(int strategy, const Command & cmd, int inFd, int outFd) {
+
+    // Resolved and built before forking, so a vfork child only has to dup2() and exec
+    string path;
+    if (!resolveCommand(cmd.argv[0], path)) {
+        return -1;
+    }
+    vector<char *> argv;
+    for (int i = 0; i < cmd.argv.size(); i++) {
+        argv.push_back((char *) cmd.argv[i].c_str());
+    }
+    argv.push_back(NULL);
+
+    int fileFd = -1;
+    if (!cmd.outFile.empty()) {
+        fileFd = open(cmd.outFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fileFd == -1) {
+            return -1;
+        }
+        outFd = fileFd;
+    }
+
+    pid_t pid = -1;
+    if (strategy == SPAWN_FORK) {
+        pid = fork();
+        if (pid == 0) {
+            if (inFd != -1) dup2(inFd, STDIN_FILENO);
+            if (outFd != -1) dup2(outFd, STDOUT_FILENO);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+    } else if (strategy == SPAWN_VFORK) {
+        pid = vfork();
+        if (pid == 0) {
+            if (inFd != -1) dup2(inFd, STDIN_FILENO);
+            if (outFd != -1) dup2(outFd, STDOUT_FILENO);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+    } else {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (inFd != -1) posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        if (outFd != -1) posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+        if (posix_spawn(&pid, path.c_str(), &actions, NULL, argv.data(), environ) != 0) {
+            pid = -1;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    if (fileFd != -1) {
+        close(fileFd);
+    }
+    return pid;
+}
+
+
+/* waitDirect()
+Waits for every child started by launchDirect(), skipping the ones that failed to start.
+*/
+
+void waitDirect(const vector<pid_t> & pids) {
+
+    int status;
+    for (int i = 0; i < pids.size(); i++) {
+        if (pids[i] > 0) waitpid(pids[i], &status, 0);
+    }
+}
+
+
+/* runDirectPipeline()
+Runs stages joined by pipes, like a | pipeline, with one of the low-level strategies and waits for them all.
+Parameters:
+    -strategy is SPAWN_FORK, SPAWN_VFORK or SPAWN_POSIX
+    -stages are the commands, first to last
+*/
+
+void runDirectPipeline(int strategy, const vector<Command> & stages) {
+
+    vector<pid_t> pids;
+    int inFd = -1;
+    for (int i = 0; i < stages.size(); i++) {
+        int fds[2] = {-1, -1};
+        if (i + 1 < stages.size() && makePipe(fds) == -1) {
+            break;
+        }
+        pids.push_back(launchDirect(strategy, stages[i], inFd, fds[WRITE]));
+
+        // The children have their own copies now
+        if (inFd != -1) close(inFd);
+        if (fds[WRITE] != -1) close(fds[WRITE]);
+        inFd = fds[READ];
+    }
+    if (inFd != -1) {
+        close(inFd);
+    }
+    waitDirect(pids);
+}
+
+
+/* runDirectFanOut()
+Runs a $ command with one left-side command, like executeDollarCommand(), but launches every command with one of
+the low-level strategies. The data still goes through fanOut(), so only the cost of starting the commands differs.
+Parameters:
+    -strategy is SPAWN_FORK, SPAWN_VFORK or SPAWN_POSIX
+    -dollarCmd is the command; only its first left-side command is run
+*/
+
+void runDirectFanOut(int strategy, const DollarCommand & dollarCmd) {
+
+    vector<pid_t> pids;
+    vector<int> targets;
+    for (int i = 0; i < dollarCmd.right.size(); i++) {
+        int fds[2];
+        if (makePipe(fds) == -1) {
+            break;
+        }
+        pid_t pid = launchDirect(strategy, dollarCmd.right[i], fds[READ], -1);
+        close(fds[READ]);
+        if (pid > 0) {
+            pids.push_back(pid);
+            targets.push_back(fds[WRITE]);
+        } else {
+            close(fds[WRITE]);
+        }
+    }
+
+    int fds[2];
+    if (makePipe(fds) == 0) {
+        pids.push_back(launchDirect(strategy, dollarCmd.left[0], -1, fds[WRITE]));
+        close(fds[WRITE]);
+
+        Usage relay;
+        signal(SIGPIPE, SIG_IGN);
+        fanOut(fds[READ], targets, relay);
+        signal(SIGPIPE, SIG_DFL);
+        close(fds[READ]);
+    }
+
+    for (int i = 0; i < targets.size(); i++) {
+        close(targets[i]);
+    }
+    waitDirect(pids);
+}
+
+
+/* runBenchLine()
+Runs one | workload once with a strategy: system() hands line to /bin/sh, the shell strategy runs line through
+executeNormalCommand(), and the rest launch stages directly.
+*/
+
+void runBenchLine(int strategy, const string & line, const vector<Command> & stages) {
+
+    if (strategy == SPAWN_SYSTEM) {
+        system(line.c_str());
+    } else if (strategy == SPAWN_SHELL) {
+        executeNormalCommand(line);
+    } else {
+        runDirectPipeline(strategy, stages);
+    }
+}
+
+
+/* printBenchRow()
+Prints one benchmark result as a CSV line or a JSON object, with the median and 99th percentile of the samples.
+Throughput is the bytes moved per run over the median time, or 0 for workloads that move no data.
+*/
+
+void printBenchRow(bool json, bool & first, const char * workload, int strategy, vector<double> & samples, long bytes) {
+
+    sort(samples.begin(), samples.end());
+    double p50 = samples[samples.size() / 2];
+    double p99 = samples[min(samples.size() - 1, samples.size() * 99 / 100)];
+    double mbPerSecond = bytes > 0 ? bytes / p50 / (1 << 20) : 0;
+
+    if (json) {
+        printf("%s  {\"workload\": \"%s\", \"strategy\": \"%s\", \"runs\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+            "\"mb_per_second\": %.1f}", first ? "" : ",\n", workload, strategyNames[strategy], (int) samples.size(),
+            p50 * 1e6, p99 * 1e6, mbPerSecond);
+    } else {
+        printf("%s,%s,%d,%.1f,%.1f,%.1f\n", workload, strategyNames[strategy], (int) samples.size(), p50 * 1e6,
+            p99 * 1e6, mbPerSecond);
+    }
+    first = false;
+    fflush(stdout);
+}
+
+
+/* runSpawnBenchmark()
+Measures what launching commands costs, and prints a table of p50/p99 latency and pipe throughput per workload and
+launch strategy:
+    noop            one "true" launched and waited for
+    pipeline-N      N "true" stages joined by |
+    pipe            BENCH_PIPE_BYTES through head | cat
+    fanout-M        BENCH_FANOUT_BYTES from one left-side command to M right-side commands with $
+Every workload runs with every strategy, except that system() has no $ and so no fanout rows. "true" is given to
+system() by its full path, so /bin/sh execs it like the other strategies do instead of running its builtin.
+Each latency workload runs reps times after a few untimed warmups; the data workloads run reps / 40 times, at least 3.
+Parameters:
+    -format is "csv" or "json"
+    -reps is the number of timed runs of each latency workload
+*/
+
+void runSpawnBenchmark(const char * format, int reps) {
+
+    bool json = strcmp(format, "json") == 0;
+    bool first = true;
+    int dataReps = max(3, reps / 40);
+    int warmups = 3;
+
+    if (json)
+        printf("[\n");
+    else
+        printf("workload,strategy,runs,p50_us,p99_us,mb_per_second\n");
+
+    string truePath;
+    if (!resolveCommand("true", truePath)) {
+        truePath = "/bin/true";
+    }
+    Command trueCmd;
+    trueCmd.argv = {truePath};
+
+    // noop and pipeline-N: one short-lived program, then deep | pipelines of them
+    for (int depth = 1; depth <= 32; depth *= depth == 1 ? 2 : 4) {
+        string line = truePath;
+        for (int i = 1; i < depth; i++) {
+            line += " | " + truePath;
+        }
+        vector<Command> stages(depth, trueCmd);
+        char workload[32];
+        if (depth == 1)
+            snprintf(workload, sizeof(workload), "noop");
+        else
+            snprintf(workload, sizeof(workload), "pipeline-%d", depth);
+
+        for (int strategy = 0; strategy < NUM_STRATEGIES; strategy++) {
+            vector<double> samples;
+            for (int run = -warmups; run < reps; run++) {
+                double start = now();
+                runBenchLine(strategy, line, stages);
+                if (run >= 0) samples.push_back(now() - start);
             }
-        
-            vector<string> outCmds;
-            space = right.find(" ");
-            if (space != string::npos) {
-                // Two left-side commands
-                outCmds.push_back(right.substr(0, space));
-                outCmds.push_back(right.substr(space+1, strlen(right.c_str())-space));
-            } else {
-                // Only one left-side command
-                outCmds.push_back(right);
+            printBenchRow(json, first, workload, strategy, samples, 0);
+        }
+    }
+
+    // pipe: bulk data through one | into /dev/null
+    string pipeLine = "head -c " + to_string(BENCH_PIPE_BYTES) + " /dev/zero | cat > /dev/null";
+    vector<Command> pipeStages(2);
+    pipeStages[0].argv = {"head", "-c", to_string(BENCH_PIPE_BYTES), "/dev/zero"};
+    pipeStages[1].argv = {"cat"};
+    pipeStages[1].outFile = "/dev/null";
+    for (int strategy = 0; strategy < NUM_STRATEGIES; strategy++) {
+        vector<double> samples;
+        for (int run = 0; run < dataReps; run++) {
+            double start = now();
+            runBenchLine(strategy, pipeLine, pipeStages);
+            samples.push_back(now() - start);
+        }
+        printBenchRow(json, first, "pipe", strategy, samples, BENCH_PIPE_BYTES);
+    }
+
+    // fanout-M: one left-side command fanned out to M right-side commands, relayed by fanOut()
+    for (int width = 1; width <= 16; width *= 4) {
+        DollarCommand dollarCmd;
+        dollarCmd.left.resize(1);
+        dollarCmd.left[0].argv = {"head", "-c", to_string(BENCH_FANOUT_BYTES), "/dev/zero"};
+        dollarCmd.right.resize(width);
+        for (int i = 0; i < width; i++) {
+            dollarCmd.right[i].argv = {"cat"};
+            dollarCmd.right[i].outFile = "/dev/null";
+        }
+        char workload[32];
+        snprintf(workload, sizeof(workload), "fanout-%d", width);
+
+        for (int strategy = SPAWN_FORK; strategy < NUM_STRATEGIES; strategy++) {
+            vector<double> samples;
+            for (int run = 0; run < dataReps; run++) {
+                double start = now();
+                if (strategy == SPAWN_SHELL) executeDollarCommand(workload, dollarCmd);
+                else runDirectFanOut(strategy, dollarCmd);
+                samples.push_back(now() - start);
+            }
+            printBenchRow(json, first, workload, strategy, samples, BENCH_FANOUT_BYTES);
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+}
+
+
+/* main()
+Loop prompting the user for commands and tokenizing the command to look for $, until the exit builtin or the end of input. Passes
+commands to other functions above for execution, which report invalid commands. With a script argument, runs it in batch mode
+instead.
+*/
+
+int main(int argc, char * argv[])
+{
+
+    // Batch mode runs up to one line per CPU at once unless -j says otherwise
+    int parallelism = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    const char * benchFormat = NULL;
+    int benchRepetitions = 200;
+    const char * historyPath = NULL;
+    while ((opt = getopt(argc, argv, "j:l:b:r:p:H:")) != -1) {
+        if (opt == 'b' && (strcmp(optarg, "csv") == 0 || strcmp(optarg, "json") == 0)) {
+            benchFormat = optarg;
+        } else if (opt == 'r' && atoi(optarg) >= 1) {
+            benchRepetitions = atoi(optarg);
+        } else if (opt == 'H') {
+            historyPath = optarg;
+        } else if (opt == 'p' && atoi(optarg) >= 4096) {
+            pipeCapacity = setupPipeCapacity(atoi(optarg));
+        } else if (opt == 'j' && atoi(optarg) >= 1) {
+            parallelism = atoi(optarg);
+        } else if (opt == 'l') {
+            // One JSON object per command, appended
+            usageLog = fopen(optarg, "a");
+            if (usageLog == NULL) {
+                printf("Error opening %s: %s\n", optarg, strerror(errno));
+                return 1;
             }
+        } else {
+            printf("Usage: %s [-j jobs] [-l usage.jsonl] [-b csv|json] [-r reps] [-p pipebytes] [-H historyfile] [script|-]\n", argv[0]);
+            exit(0);
+        }
+    }
+
+    if (benchFormat != NULL) {
+        runSpawnBenchmark(benchFormat, benchRepetitions);
+        return 0;
+    }
+
+    if (optind < argc) {
+        if (strcmp(argv[optind], "-") == 0) {
+            return runBatch(cin, parallelism);
+        }
+        ifstream script(argv[optind]);
+        if (!script) {
+            printf("Error opening %s\n", argv[optind]);
+            return 1;
+        }
+        return runBatch(script, parallelism);
+    }
+
+    cout << "\nType \"exit\" to quit the program\n\n" << endl;
 
-            // Pass left and right side commands to execution function, for each right-side command
+    // Interactive commands go to ~/.shell_simulator_history unless -H names another file
+    string defaultHistory;
+    if (historyPath == NULL && getenv("HOME") != NULL) {
+        defaultHistory = string(getenv("HOME")) + "/.shell_simulator_history";
+        historyPath = defaultHistory.c_str();
+    }
+    if (historyPath != NULL && !openHistory(historyPath)) {
+        printf("Error opening history file %s: %s\n", historyPath, strerror(errno));
+    }
 
-            for (int i = 0; i < outCmds.size(); i++) {
+    // Background jobs are reaped as they finish. SIGTTOU is ignored so fg can take the terminal back
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchldHandler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    signal(SIGTTOU, SIG_IGN);
 
-                int rightCmd = fork();
-                if (rightCmd == -1) {
-                    printf("Error forking for a right-side command\n");
-                } else if (rightCmd == 0) {
-                    rightSideCommand(inCmds, outCmds.at(i));
-                    exit(0);
-                } else {
-                    int status;
-                    waitpid(rightCmd, &status, 0);
-                }
-            } 
+    int status = 0;
+    while(!exitRequested) {
+        // Tell the user about background jobs that finished since the last prompt
+        sigset_t oldMask;
+        blockSigchld(&oldMask);
+        reportJobs();
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+        string prompt = "/User/ % ";
+        cout << prompt;
+        string cmd;
+        if (!getline(cin, cmd)) {
+            return status;
+        }
+        if (!expandHistory(cmd)) {
+            continue;
+        }
+        if (cmd.find_first_not_of(" \t") != string::npos) {
+            addHistory(cmd);
+        }
+        timeCommand = stripTimePrefix(cmd);
+
+        int result = executeLine(cmd);
+        if (result != -1) {
+            status = result;
         }
     }
-    return 0; 
+    return status; 
 }
\ No newline at end of file